@@ -0,0 +1,308 @@
+#include <signal.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+#include "core/stpp.h"
+
+// The micro benchmarks of the coroutine primitives and the socket paths, each runs
+// a warmup and then the repeats, the median and the min are reported in JSON or CSV.
+//      bench [--format json|csv] [--filter name] [--repeat n] [--scale x] [--port p]
+namespace bench {
+	struct Options {
+		std::string format = "json";
+		std::string filter;
+		int repeat = 5;
+		double scale = 1.0;
+		int port = 39100;
+	};
+
+	struct Result {
+		std::string name;
+		int64_t ops;
+		double ns_per_op;
+		double min_ns_per_op;
+		double ops_per_sec;
+		double mb_per_sec;
+	};
+
+	// Run n ops and return the elapsed ns.
+	using BenchFn = std::function<int64_t(int64_t n)>;
+
+	struct Case {
+		const char* name;
+		int64_t ops;
+		// The bytes moved by each op, for the throughput.
+		int64_t bytes_per_op;
+		BenchFn fn;
+	};
+
+	static int64_t now_ns() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static Result run(const Case& c, const Options& opts) {
+		int64_t ops = std::max<int64_t>(1, (int64_t)(c.ops * opts.scale));
+		c.fn(std::max<int64_t>(1, ops / 10));
+
+		std::vector<double> samples;
+		for (int i = 0; i < opts.repeat; i++) {
+			samples.push_back((double)c.fn(ops) / ops);
+		}
+		std::sort(samples.begin(), samples.end());
+
+		Result r;
+		r.name = c.name;
+		r.ops = ops;
+		r.ns_per_op = samples[samples.size() / 2];
+		r.min_ns_per_op = samples.front();
+		r.ops_per_sec = r.ns_per_op > 0 ? 1e9 / r.ns_per_op : 0;
+		r.mb_per_sec = c.bytes_per_op * r.ops_per_sec / (1024 * 1024);
+		return r;
+	}
+
+	static int64_t coroutine_create_join(int64_t n) {
+		int64_t start = now_ns();
+		for (int64_t i = 0; i < n; i++) {
+			st::coroutine co(1, []() {});
+		}
+		return now_ns() - start;
+	}
+
+	// Two coroutines yield to each other, an op is one switch.
+	static int64_t yield_switch(int64_t n) {
+		int64_t half = std::max<int64_t>(1, n / 2);
+		int64_t start = now_ns();
+		{
+			st::coroutine a(1, [half]() { for (int64_t i = 0; i < half; i++) st::this_coroutine::yield(); });
+			st::coroutine b(1, [half]() { for (int64_t i = 0; i < half; i++) st::this_coroutine::yield(); });
+		}
+		return now_ns() - start;
+	}
+
+	static int64_t mutex_uncontended(int64_t n) {
+		st::mutex m;
+		int64_t start = now_ns();
+		for (int64_t i = 0; i < n; i++) {
+			m.lock();
+			m.unlock();
+		}
+		return now_ns() - start;
+	}
+
+	// Four coroutines yield while holding the mutex, so each lock waits for the others.
+	static int64_t mutex_contended(int64_t n) {
+		const int workers = 4;
+		int64_t each = std::max<int64_t>(1, n / workers);
+		st::mutex m;
+		int64_t start = now_ns();
+		{
+			std::vector<st::coroutine> cos;
+			for (int w = 0; w < workers; w++) {
+				cos.emplace_back(1, [&m, each]() {
+					for (int64_t i = 0; i < each; i++) {
+						m.lock();
+						st::this_coroutine::yield();
+						m.unlock();
+					}
+					});
+			}
+		}
+		return now_ns() - start;
+	}
+
+	// Two coroutines signal each other by the condition variables, an op is a round trip.
+	static int64_t cond_pingpong(int64_t n) {
+		st::condition_variable ping, pong;
+		int64_t turn = 0;
+		int64_t start = now_ns();
+		{
+			st::coroutine a(1, [&]() {
+				for (int64_t i = 0; i < n; i++) {
+					turn = 1;
+					ping.notify_one();
+					while (turn != 0) pong.wait();
+				}
+				});
+			st::coroutine b(1, [&]() {
+				for (int64_t i = 0; i < n; i++) {
+					while (turn != 1) ping.wait();
+					turn = 0;
+					pong.notify_one();
+				}
+				});
+		}
+		return now_ns() - start;
+	}
+
+	static st::error_t connect(int port, st::SocketPtr* psock) {
+		st::error_t err;
+		st::netfd_t stfd = NULL;
+		if ((err = st::__detail::srs_tcp_connect("127.0.0.1", port, 3 * UTIME_SECONDS, &stfd)) != error_ok) {
+			return error_trace(err);
+		}
+		psock->reset(new st::Socket());
+		return (*psock)->initialize(stfd);
+	}
+
+	// Write 64KB chunks over a loopback TCP connection, an op is one chunk.
+	static const int CHUNK_SIZE = 64 * 1024;
+	static int64_t socket_loopback(int64_t n, int port) {
+		st::netfd_t lfd = NULL;
+		st::error_t err = st::__detail::tcp_listen("127.0.0.1", port, &lfd);
+		if (err) {
+			fprintf(stderr, "listen failed: %s\n", err->what().c_str());
+			return 0;
+		}
+
+		int64_t start = now_ns();
+		int64_t received = 0;
+		{
+			st::coroutine reader(1, [&]() {
+				st::netfd_t cfd = st_accept(lfd, NULL, NULL, ST_UTIME_NO_TIMEOUT);
+				if (cfd == NULL) {
+					return;
+				}
+				st::Socket sock;
+				sock.initialize(cfd);
+				std::vector<char> buf(CHUNK_SIZE);
+				while (received < n * CHUNK_SIZE) {
+					ssize_t nread = 0;
+					if (sock.read(buf.data(), buf.size(), &nread) != error_ok) {
+						break;
+					}
+					received += nread;
+				}
+				});
+
+			st::SocketPtr sock;
+			if ((err = connect(port, &sock)) != error_ok) {
+				fprintf(stderr, "connect failed: %s\n", err->what().c_str());
+				reader.terminate();
+			}
+
+			std::vector<char> buf(CHUNK_SIZE, 'x');
+			for (int64_t i = 0; sock && i < n; i++) {
+				if (sock->write(buf.data(), buf.size(), NULL) != error_ok) {
+					break;
+				}
+			}
+		}
+		int64_t elapsed = now_ns() - start;
+		st::__detail::close_stfd(lfd);
+		return elapsed;
+	}
+
+	// Round trips of 64 bytes to an echo TcpServer.
+	static int64_t tcpserver_echo(int64_t n, int port) {
+		st::SocketPtr sock;
+		st::error_t err = connect(port, &sock);
+		if (err) {
+			fprintf(stderr, "connect failed: %s\n", err->what().c_str());
+			return 0;
+		}
+
+		char msg[64];
+		memset(msg, 'x', sizeof(msg));
+		int64_t start = now_ns();
+		for (int64_t i = 0; i < n; i++) {
+			if (sock->write(msg, sizeof(msg), NULL) != error_ok) {
+				break;
+			}
+			if (sock->read_fully(msg, sizeof(msg), NULL) != error_ok) {
+				break;
+			}
+		}
+		return now_ns() - start;
+	}
+
+	static void print(const std::vector<Result>& results, const Options& opts) {
+		if (opts.format == "csv") {
+			printf("name,ops,ns_per_op,min_ns_per_op,ops_per_sec,mb_per_sec\n");
+			for (auto& r : results) {
+				printf("%s,%lld,%.2f,%.2f,%.0f,%.2f\n", r.name.c_str(), (long long)r.ops,
+					r.ns_per_op, r.min_ns_per_op, r.ops_per_sec, r.mb_per_sec);
+			}
+			return;
+		}
+
+		printf("{\n  \"repeat\": %d,\n  \"benchmarks\": [\n", opts.repeat);
+		for (size_t i = 0; i < results.size(); i++) {
+			const Result& r = results[i];
+			printf("    {\"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"ops_per_sec\": %.0f, \"mb_per_sec\": %.2f}%s\n",
+				r.name.c_str(), (long long)r.ops, r.ns_per_op, r.min_ns_per_op, r.ops_per_sec, r.mb_per_sec,
+				i + 1 < results.size() ? "," : "");
+		}
+		printf("  ]\n}\n");
+	}
+
+	static bool parse(int argc, char** argv, Options* opts) {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (i + 1 >= argc) {
+				return false;
+			}
+			std::string v = argv[++i];
+			if (arg == "--format") opts->format = v;
+			else if (arg == "--filter") opts->filter = v;
+			else if (arg == "--repeat") opts->repeat = std::max(1, atoi(v.c_str()));
+			else if (arg == "--scale") opts->scale = atof(v.c_str());
+			else if (arg == "--port") opts->port = atoi(v.c_str());
+			else return false;
+		}
+		return opts->format == "json" || opts->format == "csv";
+	}
+}
+
+int main(int argc, char** argv) {
+	bench::Options opts;
+	if (!bench::parse(argc, argv, &opts)) {
+		fprintf(stderr, "usage: %s [--format json|csv] [--filter name] [--repeat n] [--scale x] [--port p]\n", argv[0]);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	st::LogStream::setLogLevel(ERROR);
+	st::error_t err = st::enable_coroutine();
+	if (err) {
+		fprintf(stderr, "%s\n", err->what().c_str());
+		return -1;
+	}
+
+	int echo_port = opts.port + 1;
+	st::RawCodec codec;
+	st::TcpServer svr("127.0.0.1", echo_port);
+	svr.onNewConnection(&codec, [](st::TcpConnectionPtr conn) {
+		while (conn->read([&](std::string_view msg) { conn->write((void*)msg.data(), msg.size()); }) == error_ok) {
+		}
+		});
+	if ((err = svr.start()) != error_ok) {
+		fprintf(stderr, "%s\n", err->what().c_str());
+		return -1;
+	}
+
+	std::vector<bench::Case> cases = {
+		{ "coroutine_create_join", 100000, 0, bench::coroutine_create_join },
+		{ "yield_switch", 1000000, 0, bench::yield_switch },
+		{ "mutex_uncontended", 10000000, 0, bench::mutex_uncontended },
+		{ "mutex_contended", 1000000, 0, bench::mutex_contended },
+		{ "cond_pingpong", 500000, 0, bench::cond_pingpong },
+		{ "socket_loopback", 4096, bench::CHUNK_SIZE, [&](int64_t n) { return bench::socket_loopback(n, opts.port); } },
+		{ "tcpserver_echo", 50000, 128, [&](int64_t n) { return bench::tcpserver_echo(n, echo_port); } },
+	};
+
+	std::vector<bench::Result> results;
+	for (auto& c : cases) {
+		if (!opts.filter.empty() && std::string(c.name).find(opts.filter) == std::string::npos) {
+			continue;
+		}
+		results.push_back(bench::run(c, opts));
+	}
+	bench::print(results, opts);
+
+	svr.stop();
+	return 0;
+}
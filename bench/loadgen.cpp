@@ -0,0 +1,300 @@
+#include <signal.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "core/stpp.h"
+
+// The load generator of the TcpServer, every connection is a coroutine which sends a
+// request and waits for the response.
+//  closed loop: send the next request once the response arrives, the default.
+//  open loop: send at the fixed total rate, the latency is measured from the time the
+//      request should have been sent, so a stalled server is not hidden by the clients
+//      waiting for it, which is the coordinated omission.
+//      loadgen [--host h] [--port p] [--connections n] [--threads n] [--duration s]
+//              [--rate r] [--mode http|echo] [--size bytes] [--path /] [--json]
+namespace loadgen {
+	struct Options {
+		std::string host = "127.0.0.1";
+		int port = 33333;
+		int connections = 100;
+		int threads = 1;
+		int duration = 10;
+		// The requests per second of all connections, 0 for closed loop.
+		double rate = 0;
+		std::string mode = "http";
+		int size = 64;
+		std::string path = "/";
+		bool json = false;
+	};
+
+	struct Stats {
+		st::Histogram latency;
+		uint64_t requests = 0;
+		uint64_t errors = 0;
+		uint64_t reconnects = 0;
+		int64_t bytes = 0;
+
+		void merge(const Stats& o) {
+			latency.merge(o.latency);
+			requests += o.requests;
+			errors += o.errors;
+			reconnects += o.reconnects;
+			bytes += o.bytes;
+		}
+	};
+
+	class Client {
+	public:
+		Client(const Options& opts, Stats* stats) :opts_(opts), stats_(stats) {
+			if (opts.mode == "http") {
+				request_ = "GET " + opts.path + " HTTP/1.1\r\nHost: " + opts.host + "\r\nConnection: keep-alive\r\n\r\n";
+			}
+			else {
+				request_.assign(opts.size, 'x');
+			}
+		}
+
+		// Run until the deadline, in us of st_utime.
+		void run(st::utime_t deadline, st::utime_t interval) {
+			st::utime_t next = (st::utime_t)st_utime();
+			while (true) {
+				st::utime_t start = (st::utime_t)st_utime();
+				if (interval > 0) {
+					if (next > start) {
+						st_usleep(next - start);
+					}
+					start = next;
+					next += interval;
+				}
+
+				if (start >= deadline) {
+					break;
+				}
+
+				if (!request()) {
+					stats_->errors++;
+					// Don't spin on a dead server.
+					st_usleep(10 * UTIME_MILLISECONDS);
+					continue;
+				}
+				stats_->requests++;
+				stats_->latency.record((st::utime_t)st_utime() - start);
+			}
+		}
+
+	private:
+		// Send the request and read the response, reconnect once if the server closed the
+		// connection, for example a server without keep-alive.
+		bool request() {
+			for (int retry = 0; retry < 2; retry++) {
+				if (!sock_ && !connect()) {
+					return false;
+				}
+				if (roundtrip()) {
+					return true;
+				}
+				sock_.reset();
+				in_.clear();
+				if (retry == 0) {
+					stats_->reconnects++;
+				}
+			}
+			return false;
+		}
+
+		bool connect() {
+			st::netfd_t stfd = NULL;
+			if (st::__detail::srs_tcp_connect(opts_.host, opts_.port, 3 * UTIME_SECONDS, &stfd) != error_ok) {
+				return false;
+			}
+			sock_.reset(new st::Socket());
+			sock_->initialize(stfd);
+			sock_->set_recv_timeout(10 * UTIME_SECONDS);
+			sock_->set_send_timeout(10 * UTIME_SECONDS);
+			return true;
+		}
+
+		bool roundtrip() {
+			if (sock_->write((void*)request_.data(), request_.size(), NULL) != error_ok) {
+				return false;
+			}
+			stats_->bytes += request_.size();
+
+			if (opts_.mode != "http") {
+				in_.ensure_writable(request_.size());
+				if (sock_->read_fully(in_.tail(), request_.size(), NULL) != error_ok) {
+					return false;
+				}
+				stats_->bytes += request_.size();
+				return true;
+			}
+
+			// Read the headers, then the body by the content length.
+			size_t header_size = 0;
+			while ((header_size = find_headers()) == 0) {
+				if (!fill()) {
+					return false;
+				}
+			}
+
+			size_t total = header_size + content_length(header_size);
+			while (in_.size() < total) {
+				if (!fill()) {
+					return false;
+				}
+			}
+			stats_->bytes += total;
+			in_.consume(total);
+			return true;
+		}
+
+		bool fill() {
+			in_.ensure_writable(4096);
+			ssize_t nread = 0;
+			if (sock_->read(in_.tail(), in_.writable(), &nread) != error_ok) {
+				return false;
+			}
+			in_.commit(nread);
+			return true;
+		}
+
+		// The bytes of the headers with the empty line, 0 if incomplete.
+		size_t find_headers() {
+			std::string_view v(in_.data(), in_.size());
+			size_t pos = v.find("\r\n\r\n");
+			return pos == std::string_view::npos ? 0 : pos + 4;
+		}
+
+		size_t content_length(size_t header_size) {
+			std::string_view v(in_.data(), header_size);
+			const char* key = "content-length:";
+			for (size_t pos = 0; pos < v.size();) {
+				size_t end = v.find("\r\n", pos);
+				std::string_view line = v.substr(pos, end - pos);
+				if (line.size() > strlen(key) && strncasecmp(line.data(), key, strlen(key)) == 0) {
+					return (size_t)atoll(std::string(line.substr(strlen(key))).c_str());
+				}
+				pos = end + 2;
+			}
+			return 0;
+		}
+
+	private:
+		const Options& opts_;
+		Stats* stats_;
+		std::string request_;
+		st::SocketPtr sock_;
+		st::Buffer in_;
+	};
+
+	// Run the connections of a thread in its own ST scheduler.
+	static void worker(const Options& opts, int connections, Stats* stats) {
+		if (st::enable_coroutine() != error_ok) {
+			stats->errors++;
+			return;
+		}
+		st::coroutine::set_default_stack_size(64 * 1024);
+
+		st::utime_t deadline = (st::utime_t)st_utime() + opts.duration * UTIME_SECONDS;
+		st::utime_t interval = 0;
+		if (opts.rate > 0) {
+			interval = std::max<st::utime_t>(1, (st::utime_t)(opts.connections * 1e6 / opts.rate));
+		}
+
+		std::vector<st::coroutine> cos;
+		for (int i = 0; i < connections; i++) {
+			cos.emplace_back(1, [&, i]() {
+				Client client(opts, stats);
+				// Spread the first requests of the open loop over the interval.
+				if (interval > 0) {
+					st_usleep(interval * i / std::max(1, connections));
+				}
+				client.run(deadline, interval);
+				});
+		}
+	}
+
+	static void report(const Options& opts, const Stats& stats, double elapsed) {
+		const st::Histogram& h = stats.latency;
+		double rps = elapsed > 0 ? stats.requests / elapsed : 0;
+		if (opts.json) {
+			printf("{\"connections\": %d, \"threads\": %d, \"duration\": %.2f, \"rate\": %.0f, \"requests\": %llu, "
+				"\"errors\": %llu, \"reconnects\": %llu, \"rps\": %.0f, \"mb_per_sec\": %.2f, "
+				"\"latency_us\": {\"mean\": %.1f, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}}\n",
+				opts.connections, opts.threads, elapsed, opts.rate, (unsigned long long)stats.requests,
+				(unsigned long long)stats.errors, (unsigned long long)stats.reconnects, rps,
+				elapsed > 0 ? stats.bytes / elapsed / (1024 * 1024) : 0, h.mean(),
+				(long long)h.percentile(50), (long long)h.percentile(90), (long long)h.percentile(99),
+				(long long)h.percentile(99.9), (long long)h.max());
+			return;
+		}
+
+		printf("%s loop, %d connections, %d threads, %.2fs\n", opts.rate > 0 ? "open" : "closed", opts.connections, opts.threads, elapsed);
+		printf("  requests %llu, errors %llu, reconnects %llu\n", (unsigned long long)stats.requests,
+			(unsigned long long)stats.errors, (unsigned long long)stats.reconnects);
+		printf("  throughput %.0f req/s, %.2f MB/s\n", rps, elapsed > 0 ? stats.bytes / elapsed / (1024 * 1024) : 0);
+		printf("  latency(us) mean %.1f, p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld\n", h.mean(),
+			(long long)h.percentile(50), (long long)h.percentile(90), (long long)h.percentile(99),
+			(long long)h.percentile(99.9), (long long)h.max());
+	}
+
+	static bool parse(int argc, char** argv, Options* opts) {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "--json") {
+				opts->json = true;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				return false;
+			}
+			std::string v = argv[++i];
+			if (arg == "--host") opts->host = v;
+			else if (arg == "--port") opts->port = atoi(v.c_str());
+			else if (arg == "--connections") opts->connections = std::max(1, atoi(v.c_str()));
+			else if (arg == "--threads") opts->threads = std::max(1, atoi(v.c_str()));
+			else if (arg == "--duration") opts->duration = std::max(1, atoi(v.c_str()));
+			else if (arg == "--rate") opts->rate = atof(v.c_str());
+			else if (arg == "--mode") opts->mode = v;
+			else if (arg == "--size") opts->size = std::max(1, atoi(v.c_str()));
+			else if (arg == "--path") opts->path = v;
+			else return false;
+		}
+		return opts->mode == "http" || opts->mode == "echo";
+	}
+}
+
+int main(int argc, char** argv) {
+	loadgen::Options opts;
+	if (!loadgen::parse(argc, argv, &opts)) {
+		fprintf(stderr, "usage: %s [--host h] [--port p] [--connections n] [--threads n] [--duration s] "
+			"[--rate r] [--mode http|echo] [--size bytes] [--path /] [--json]\n", argv[0]);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	st::LogStream::setLogLevel(ERROR);
+
+	std::vector<loadgen::Stats> stats(opts.threads);
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < opts.threads; i++) {
+		int connections = opts.connections / opts.threads + (i < opts.connections % opts.threads ? 1 : 0);
+		threads.emplace_back(loadgen::worker, std::cref(opts), connections, &stats[i]);
+	}
+	for (auto& it : threads) {
+		it.join();
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	loadgen::Stats total;
+	for (auto& it : stats) {
+		total.merge(it);
+	}
+	loadgen::report(opts, total, elapsed);
+	return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include "net.hpp"
+#include "metrics.hpp"
+
+// The max bytes of a request to the admin server.
+#define ADMIN_MAX_REQUEST_SIZE (16 * 1024)
+// The admin connections idle for it are closed.
+#define ADMIN_IDLE_TIMEOUT (10 * UTIME_SECONDS)
+
+namespace st {
+	// The optional admin server in the current ST thread, which serves the metrics of all
+	// threads in the Prometheus text format, each request is answered and closed.
+	//      curl http://127.0.0.1:9100/metrics
+	class AdminServer {
+	public:
+		AdminServer(const char* host, int port) :svr_(host, port) {
+			// Register the metrics of the library, so they are scraped before used.
+			__detail::builtin_metrics::get();
+			svr_.set_max_connections(16);
+			svr_.set_idle_timeout(ADMIN_IDLE_TIMEOUT);
+			svr_.onNewConnection(&codec_, [](TcpConnectionPtr conn) { serve(conn); });
+		}
+
+		error_t start() {
+			error_t err;
+			if ((err = svr_.start()) != error_ok) {
+				return error_trace(err);
+			}
+			return err;
+		}
+
+		void stop() {
+			svr_.stop();
+		}
+
+	private:
+		static void serve(TcpConnectionPtr conn) {
+			std::string req;
+			while (req.find("\r\n\r\n") == std::string::npos) {
+				if (req.size() > ADMIN_MAX_REQUEST_SIZE) {
+					return;
+				}
+				error_t err = conn->read([&](std::string_view msg) { req.append(msg.data(), msg.size()); });
+				if (err) {
+					LOG(TRACE) << err->what();
+					return;
+				}
+			}
+
+			// For example, GET /metrics HTTP/1.1
+			std::string_view line(req.data(), req.find("\r\n"));
+			size_t sp = line.find(' ');
+			std::string_view method = line.substr(0, sp);
+			std::string_view path = sp == std::string_view::npos ? std::string_view() : line.substr(sp + 1, line.find(' ', sp + 1) - sp - 1);
+			path = path.substr(0, path.find('?'));
+
+			std::string status = "200 OK";
+			std::string body;
+			if (method != "GET") {
+				status = "405 Method Not Allowed";
+			}
+			else if (path == "/metrics") {
+				body = MetricsRegistry::instance().scrape();
+			}
+			else {
+				status = "404 Not Found";
+			}
+
+			std::string resp = "HTTP/1.1 " + status + "\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body;
+			error_t err = conn->write((void*)resp.data(), resp.size());
+			if (err) {
+				LOG(TRACE) << err->what();
+			}
+		}
+
+	private:
+		RawCodec codec_;
+		TcpServer svr_;
+	};
+}
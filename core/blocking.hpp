@@ -0,0 +1,195 @@
+#pragma once
+#include <st.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "coroutine.hpp"
+#include "mpsc.hpp"
+
+// The default max threads of the blocking pool.
+#define BLOCKING_POOL_THREADS 16
+
+namespace st {
+	struct blocking_pool_stats {
+		// The calls waiting for a thread.
+		size_t queue_depth;
+		int threads;
+		int idle;
+		uint64_t completed;
+		// The time the calls waited for a thread, in microseconds.
+		int64_t total_wait;
+		int64_t max_wait;
+	};
+
+	// The bounded pool of OS threads which run the blocking calls of the coroutines, the
+	// threads start when there's no idle one, up to the max.
+	class blocking_pool {
+	public:
+		// Never destroyed, a call may still block when the process exits.
+		static blocking_pool& instance() {
+			static blocking_pool* pool = new blocking_pool();
+			return *pool;
+		}
+
+		// The max threads, the started threads are kept.
+		void set_max_threads(int n) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			max_threads_ = n > 0 ? n : 1;
+		}
+
+		void submit(std::function<void()> fn) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (idle_ <= (int)jobs_.size() && threads_ < max_threads_) {
+				threads_++;
+				std::thread(&blocking_pool::run, this).detach();
+			}
+			jobs_.push_back(job{ std::move(fn), std::chrono::steady_clock::now() });
+			cond_.notify_one();
+		}
+
+		blocking_pool_stats stats() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return blocking_pool_stats{ jobs_.size(), threads_, idle_, completed_, total_wait_, max_wait_ };
+		}
+
+	private:
+		struct job {
+			std::function<void()> fn;
+			std::chrono::steady_clock::time_point queued;
+		};
+
+		void run() {
+			std::unique_lock<std::mutex> lock(mutex_);
+			while (true) {
+				idle_++;
+				cond_.wait(lock, [this] { return !jobs_.empty(); });
+				idle_--;
+
+				job j = std::move(jobs_.front());
+				jobs_.pop_front();
+				int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - j.queued).count();
+				total_wait_ += wait;
+				max_wait_ = std::max(max_wait_, wait);
+
+				lock.unlock();
+				j.fn();
+				lock.lock();
+				completed_++;
+			}
+		}
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		std::deque<job> jobs_;
+		int max_threads_ = BLOCKING_POOL_THREADS;
+		int threads_ = 0;
+		int idle_ = 0;
+		uint64_t completed_ = 0;
+		int64_t total_wait_ = 0;
+		int64_t max_wait_ = 0;
+	};
+
+	namespace __detail {
+		// Shared by the caller and the pool, so it's kept when the caller is interrupted.
+		struct blocking_waiter {
+			st::condition_variable cond;
+			bool done = false;
+		};
+
+		// Wake the coroutines of the ST thread when their calls are done, the pool threads
+		// push the waiters to the queue and a coroutine signals them.
+		class blocking_dispatcher {
+		public:
+			static blocking_dispatcher& instance() {
+				static thread_local blocking_dispatcher d;
+				return d;
+			}
+
+			// Called by the pool threads, which pass their references, so the waiter is
+			// released in the ST thread.
+			void complete(std::shared_ptr<blocking_waiter>&& w) {
+				queue_.push(std::move(w));
+			}
+
+			// Return false if the coroutine is interrupted before the call is done.
+			bool wait(blocking_waiter* w) {
+				if (!started_) {
+					started_ = true;
+					co_ = st::coroutine(0, &blocking_dispatcher::run, this);
+				}
+
+				while (!w->done) {
+					if (st_cond_wait(w->cond.native_handle()) == -1 && !w->done) {
+						return false;
+					}
+				}
+				return true;
+			}
+
+		private:
+			void run() {
+				std::vector<std::shared_ptr<blocking_waiter>> done;
+				while (true) {
+					done.clear();
+					if (queue_.pop_all(done) == queue_status::closed) {
+						break;
+					}
+					for (auto w : done) {
+						w->done = true;
+						w->cond.notify_one();
+					}
+				}
+			}
+
+		private:
+			mpsc_queue<std::shared_ptr<blocking_waiter>> queue_;
+			st::coroutine co_;
+			bool started_ = false;
+		};
+	}
+
+	namespace this_coroutine {
+		// Run fn in the blocking pool and park the coroutine until it's done, the other
+		// coroutines go on. Return the result of fn, or rethrow its exception. When the
+		// coroutine is interrupted, return at once and the late result is dropped, an error
+		// of ERROR_THREAD_INTERRUPED for fn returning error_t, or throw a std::system_error
+		// of EINTR for the others.
+		// @remark fn may run after the interrupted call returns, so it must own its data and
+		//		never reference the stack of the caller.
+		template<typename _Callable>
+		inline std::invoke_result_t<std::decay_t<_Callable>> run_blocking(_Callable&& fn) {
+			using _Res = std::invoke_result_t<std::decay_t<_Callable>>;
+			auto task = std::make_shared<std::packaged_task<_Res()>>(std::forward<_Callable>(fn));
+			std::future<_Res> result = task->get_future();
+
+			__detail::flush_output();
+			auto w = std::make_shared<__detail::blocking_waiter>();
+			__detail::blocking_waiter* waiter = w.get();
+			__detail::blocking_dispatcher* d = &__detail::blocking_dispatcher::instance();
+			blocking_pool::instance().submit([task, d, w]() mutable {
+				(*task)();
+				d->complete(std::move(w));
+				});
+
+			if (!d->wait(waiter)) {
+				if constexpr (std::is_same_v<_Res, error_t>) {
+					return error_new(ERROR_THREAD_INTERRUPED, "run blocking interrupted");
+				}
+				else {
+					throw std::system_error(EINTR, std::generic_category(), "run blocking interrupted");
+				}
+			}
+			return result.get();
+		}
+	}
+}
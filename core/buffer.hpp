@@ -0,0 +1,192 @@
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+namespace st {
+	// The growable byte buffer for the socket input, the readable bytes are in
+	// [rpos_, wpos_), consumed from the head while new bytes appended at the tail.
+	class Buffer {
+	public:
+		explicit Buffer(size_t capacity = 4096) {
+			cap_ = capacity > 0 ? capacity : 1;
+			rpos_ = wpos_ = 0;
+			buf_ = (char*)malloc(cap_);
+			if (buf_ == nullptr) {
+				throw std::runtime_error("Buffer malloc failed");
+			}
+		}
+
+		~Buffer() {
+			free(buf_);
+			buf_ = nullptr;
+		}
+
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
+
+		// The readable bytes.
+		char* data() { return buf_ + rpos_; }
+		size_t size() const { return wpos_ - rpos_; }
+		bool empty() const { return wpos_ == rpos_; }
+		size_t capacity() const { return cap_; }
+
+		// The free space at the tail, call ensure_writable to reserve it.
+		char* tail() { return buf_ + wpos_; }
+		size_t writable() const { return cap_ - wpos_; }
+
+		// Make sure at least n bytes are writable at the tail. The readable bytes
+		// are moved to the head first, the capacity is doubled only when that's not enough.
+		void ensure_writable(size_t n) {
+			if (writable() >= n) {
+				return;
+			}
+
+			size_t nb = size();
+			if (rpos_ > 0) {
+				memmove(buf_, buf_ + rpos_, nb);
+				rpos_ = 0;
+				wpos_ = nb;
+			}
+
+			if (writable() >= n) {
+				return;
+			}
+
+			size_t cap = cap_;
+			while (cap - nb < n) {
+				cap *= 2;
+			}
+
+			char* buf = (char*)realloc(buf_, cap);
+			if (buf == nullptr) {
+				throw std::runtime_error("Buffer realloc failed");
+			}
+			buf_ = buf;
+			cap_ = cap;
+		}
+
+		// Mark n bytes written at the tail as readable.
+		void commit(size_t n) { wpos_ += n; }
+
+		// Drop n readable bytes from the head.
+		void consume(size_t n) {
+			rpos_ += n;
+			if (rpos_ >= wpos_) {
+				rpos_ = wpos_ = 0;
+			}
+		}
+
+		void clear() { rpos_ = wpos_ = 0; }
+
+	private:
+		char* buf_;
+		size_t cap_;
+		size_t rpos_;
+		size_t wpos_;
+	};
+
+	// The iovecs of the messages to write. A piece either references the caller's
+	// memory, which is zero copy, or owns a copy, for example a small protocol header.
+	class IovecList {
+	public:
+		IovecList() :bytes_(0) {}
+
+		IovecList(const IovecList&) = delete;
+		IovecList& operator=(const IovecList&) = delete;
+
+		// Reference [p, p+n), which must stay valid until the list is written.
+		void append(const void* p, size_t n) {
+			if (n == 0) {
+				return;
+			}
+			pieces_.push_back(piece{ (const char*)p, 0, n, false, false });
+			bytes_ += n;
+		}
+
+		// Take the vector, which is released when the list is cleared.
+		void append(std::vector<unsigned char>&& v) {
+			if (v.empty()) {
+				return;
+			}
+			held_.push_back(std::move(v));
+			pieces_.push_back(piece{ (const char*)held_.back().data(), 0, held_.back().size(), false, true });
+			bytes_ += held_.back().size();
+		}
+
+		// Copy [p, p+n) into the list.
+		void append_copy(const void* p, size_t n) {
+			if (n == 0) {
+				return;
+			}
+
+			size_t off = scratch_.size();
+			scratch_.append((const char*)p, n);
+			if (!pieces_.empty() && pieces_.back().owned && pieces_.back().off + pieces_.back().len == off) {
+				pieces_.back().len += n;
+			}
+			else {
+				pieces_.push_back(piece{ nullptr, off, n, true, false });
+			}
+			bytes_ += n;
+		}
+
+		// Copy the referenced pieces from the index, so the caller can release its memory
+		// before the list is written.
+		void retain(int from) {
+			for (size_t i = (size_t)from; i < pieces_.size(); i++) {
+				piece& it = pieces_[i];
+				if (it.owned || it.held) {
+					continue;
+				}
+				it.off = scratch_.size();
+				scratch_.append(it.base, it.len);
+				it.base = nullptr;
+				it.owned = true;
+			}
+		}
+
+		// The iovecs to write, valid until the list is changed.
+		const iovec* iov() {
+			iovs_.resize(pieces_.size());
+			for (size_t i = 0; i < pieces_.size(); i++) {
+				const piece& it = pieces_[i];
+				iovs_[i].iov_base = (void*)(it.owned ? scratch_.data() + it.off : it.base);
+				iovs_[i].iov_len = it.len;
+			}
+			return iovs_.data();
+		}
+
+		int count() const { return (int)pieces_.size(); }
+		size_t bytes() const { return bytes_; }
+		bool empty() const { return pieces_.empty(); }
+
+		// Drop all pieces, keep the memory for reuse.
+		void clear() {
+			pieces_.clear();
+			scratch_.clear();
+			held_.clear();
+			bytes_ = 0;
+		}
+
+	private:
+		struct piece {
+			const char* base;
+			size_t off;
+			size_t len;
+			// The copy in scratch_.
+			bool owned;
+			// The data of a vector in held_.
+			bool held;
+		};
+
+		std::vector<piece> pieces_;
+		std::string scratch_;
+		std::vector<std::vector<unsigned char>> held_;
+		std::vector<iovec> iovs_;
+		size_t bytes_;
+	};
+}
\ No newline at end of file
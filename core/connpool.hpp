@@ -0,0 +1,335 @@
+#pragma once
+#include <st.h>
+#include <poll.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include "net.hpp"
+
+// The default max idle connections kept for each endpoint.
+#define POOL_MAX_IDLE 8
+// The default max connections, idle or leased, to each endpoint.
+#define POOL_MAX_TOTAL 64
+// The default time an idle connection is kept.
+#define POOL_IDLE_TIMEOUT (60 * UTIME_SECONDS)
+// The interval to close the idle connections of the timeout, of all endpoints.
+#define POOL_REAP_INTERVAL (1 * UTIME_SECONDS)
+
+namespace st {
+	class ConnectionPool;
+
+	// The connection leased from the ConnectionPool, which goes back to the pool when the
+	// lease is released or destroyed, or is closed if it's marked broken.
+	class PooledSocket {
+	public:
+		PooledSocket() = default;
+		~PooledSocket() { release(); }
+
+		PooledSocket(const PooledSocket&) = delete;
+		PooledSocket& operator=(const PooledSocket&) = delete;
+
+		PooledSocket(PooledSocket&& o) noexcept { *this = std::move(o); }
+		PooledSocket& operator=(PooledSocket&& o) noexcept {
+			if (this != &o) {
+				release();
+				pool_ = o.pool_;
+				key_ = std::move(o.key_);
+				sock_ = std::move(o.sock_);
+				broken_ = o.broken_;
+				reused_ = o.reused_;
+				o.pool_ = nullptr;
+			}
+			return *this;
+		}
+
+		Socket* operator->() const { return sock_.get(); }
+		Socket& operator*() const { return *sock_; }
+		SocketPtr get() const { return sock_; }
+		explicit operator bool() const { return sock_ != nullptr; }
+
+		// Whether the connection is an idle one of the pool, rather than a new one.
+		bool reused() const { return reused_; }
+
+		// Close the connection when released, for example the read or write failed, or
+		// the protocol state is unknown.
+		void mark_broken() { broken_ = true; }
+
+		// Return the connection to the pool.
+		void release();
+
+	private:
+		friend class ConnectionPool;
+		ConnectionPool* pool_ = nullptr;
+		std::string key_;
+		SocketPtr sock_;
+		bool broken_ = false;
+		bool reused_ = false;
+	};
+
+	// The pool of the client connections keyed by host:port. The idle connections are
+	// reused, the latest first, and closed when they are idle for the timeout or closed
+	// by the peer. A coroutine started by the first idle connection closes the timed out
+	// ones of all endpoints, so the endpoints no longer used don't keep them. When the
+	// connections to an endpoint reach max_total, the coroutines wait in FIFO order, a
+	// released connection is handed to the first one directly.
+	// @remark The pool belongs to one ST thread, and must outlive the leases.
+	class ConnectionPool {
+	public:
+		ConnectionPool(int max_idle = POOL_MAX_IDLE, int max_total = POOL_MAX_TOTAL, utime_t idle_timeout = POOL_IDLE_TIMEOUT)
+			:max_idle_(max_idle), max_total_(max_total > 0 ? max_total : 1), idle_timeout_(idle_timeout) {}
+
+		~ConnectionPool() {
+			if (reaping_) {
+				exit_ = true;
+				reaper_.terminate();
+				st::coroutine reaper(std::move(reaper_));
+			}
+			clear();
+		}
+
+		ConnectionPool(const ConnectionPool&) = delete;
+		ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+		// The timeout to connect a new connection.
+		void set_connect_timeout(utime_t tm) { connect_timeout_ = tm; }
+
+		// Lease a connection to host:port, reuse an idle one or connect a new one, or wait
+		// for a connection to be released when the endpoint reaches max_total.
+		// @param timeout, the max time to wait for a connection, excludes the connecting.
+		error_t get(const std::string& host, int port, PooledSocket* lease, utime_t timeout = UTIME_NO_TIMEOUT) {
+			error_t err;
+			std::string key = host + ":" + std::to_string(port);
+			// We may wait or connect, send the corked output first. It may block, so it's
+			// done before the endpoint is referenced, which the reaper may drop meanwhile.
+			__detail::flush_output();
+			endpoint& ep = endpoints_[key];
+
+			SocketPtr sock = pop_idle(ep);
+			bool reused = sock != nullptr;
+
+			if (!sock && ep.total >= max_total_) {
+				waiter w;
+				ep.waiters.push_back(&w);
+				int r = st_cond_timedwait(w.cond.native_handle(), timeout);
+
+				// We may be handed a connection even if the wait failed.
+				if (!w.sock && !w.slot) {
+					remove_waiter(ep, &w);
+					if (r == -1 && errno == ETIME) {
+						return error_new(ERROR_SOCKET_TIMEOUT, "wait connection to %s timeout %d ms", key.c_str(), u2msi(timeout));
+					}
+					return error_new(ERROR_THREAD_INTERRUPED, "wait connection to %s", key.c_str());
+				}
+				sock = std::move(w.sock);
+				reused = sock != nullptr;
+			}
+			else if (!sock) {
+				ep.total++;
+			}
+
+			// We own a slot of the endpoint, connect a new connection.
+			if (!sock) {
+				if ((err = connect(host, port, &sock)) != error_ok) {
+					close_one(ep);
+					return error_trace(err);
+				}
+			}
+
+			lease->release();
+			lease->pool_ = this;
+			lease->key_ = key;
+			lease->sock_ = sock;
+			lease->broken_ = false;
+			lease->reused_ = reused;
+			return err;
+		}
+
+		// The idle connections to host:port.
+		int idle(const std::string& host, int port) {
+			auto it = endpoints_.find(host + ":" + std::to_string(port));
+			return it != endpoints_.end() ? (int)it->second.idle.size() : 0;
+		}
+
+		// The idle and leased connections to host:port.
+		int total(const std::string& host, int port) {
+			auto it = endpoints_.find(host + ":" + std::to_string(port));
+			return it != endpoints_.end() ? it->second.total : 0;
+		}
+
+		// Close all idle connections.
+		void clear() {
+			for (auto& it : endpoints_) {
+				endpoint& ep = it.second;
+				while (!ep.idle.empty()) {
+					ep.idle.pop_back();
+					close_one(ep);
+				}
+			}
+		}
+
+	private:
+		friend class PooledSocket;
+
+		struct idle_conn {
+			SocketPtr sock;
+			utime_t since;
+		};
+
+		struct waiter {
+			st::condition_variable cond;
+			// The connection handed to the waiter.
+			SocketPtr sock;
+			// The waiter may connect a new connection, the slot is counted in total.
+			bool slot = false;
+		};
+
+		struct endpoint {
+			// The latest released at the back.
+			std::deque<idle_conn> idle;
+			std::deque<waiter*> waiters;
+			int total = 0;
+		};
+
+		void release(const std::string& key, SocketPtr sock, bool broken) {
+			endpoint& ep = endpoints_[key];
+			expire(ep);
+
+			if (broken || stale(sock)) {
+				sock.reset();
+				close_one(ep);
+				return;
+			}
+
+			if (!ep.waiters.empty()) {
+				waiter* w = ep.waiters.front();
+				ep.waiters.pop_front();
+				w->sock = std::move(sock);
+				w->cond.notify_one();
+				return;
+			}
+
+			if ((int)ep.idle.size() < max_idle_) {
+				ep.idle.push_back(idle_conn{ std::move(sock), (utime_t)st_utime() });
+				if (idle_timeout_ > 0 && !reaping_) {
+					reaping_ = true;
+					reaper_ = st::coroutine(1, &ConnectionPool::reap, this);
+				}
+				return;
+			}
+
+			sock.reset();
+			close_one(ep);
+		}
+
+		// Get the latest idle connection which is still alive.
+		SocketPtr pop_idle(endpoint& ep) {
+			expire(ep);
+			while (!ep.idle.empty()) {
+				SocketPtr sock = std::move(ep.idle.back().sock);
+				ep.idle.pop_back();
+				if (!stale(sock)) {
+					return sock;
+				}
+				sock.reset();
+				close_one(ep);
+			}
+			return nullptr;
+		}
+
+		// Close the idle connections of the timeout, the oldest are at the front.
+		void expire(endpoint& ep) {
+			if (idle_timeout_ <= 0) {
+				return;
+			}
+
+			utime_t now = (utime_t)st_utime();
+			while (!ep.idle.empty() && now - ep.idle.front().since >= idle_timeout_) {
+				ep.idle.pop_front();
+				close_one(ep);
+			}
+		}
+
+		// Close the timed out idle connections of all endpoints, and drop the endpoints
+		// without connections or waiters.
+		void reap() {
+			utime_t interval = std::min(idle_timeout_, (utime_t)POOL_REAP_INTERVAL);
+			while (!exit_) {
+				st_usleep(interval);
+				for (auto it = endpoints_.begin(); it != endpoints_.end();) {
+					expire(it->second);
+					if (it->second.total == 0 && it->second.waiters.empty()) {
+						it = endpoints_.erase(it);
+					}
+					else {
+						++it;
+					}
+				}
+			}
+		}
+
+		// A connection is closed, pass its slot to the first waiter.
+		void close_one(endpoint& ep) {
+			ep.total--;
+			if (!ep.waiters.empty()) {
+				waiter* w = ep.waiters.front();
+				ep.waiters.pop_front();
+				w->slot = true;
+				ep.total++;
+				w->cond.notify_one();
+			}
+		}
+
+		void remove_waiter(endpoint& ep, waiter* w) {
+			for (auto it = ep.waiters.begin(); it != ep.waiters.end(); ++it) {
+				if (*it == w) {
+					ep.waiters.erase(it);
+					return;
+				}
+			}
+		}
+
+		// An idle connection is readable only if the peer closed it or sent unexpected bytes,
+		// neither can be reused.
+		static bool stale(const SocketPtr& sock) {
+			pollfd pfd;
+			pfd.fd = st_netfd_fileno(sock->get_netfd());
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			return ::poll(&pfd, 1, 0) != 0;
+		}
+
+		error_t connect(const std::string& host, int port, SocketPtr* psock) {
+			error_t err;
+			netfd_t stfd = NULL;
+			if ((err = __detail::srs_tcp_connect(host, port, connect_timeout_, &stfd)) != error_ok) {
+				return error_trace(err);
+			}
+
+			SocketPtr sock(new Socket());
+			if ((err = sock->initialize(stfd)) != error_ok) {
+				__detail::close_stfd(stfd);
+				return error_trace(err);
+			}
+			*psock = sock;
+			return err;
+		}
+
+	private:
+		int max_idle_;
+		int max_total_;
+		utime_t idle_timeout_;
+		utime_t connect_timeout_ = UTIME_NO_TIMEOUT;
+		std::unordered_map<std::string, endpoint> endpoints_;
+		st::coroutine reaper_;
+		bool reaping_ = false;
+		bool exit_ = false;
+	};
+
+	inline void PooledSocket::release() {
+		if (pool_ && sock_) {
+			pool_->release(key_, std::move(sock_), broken_);
+		}
+		pool_ = nullptr;
+		sock_.reset();
+	}
+}
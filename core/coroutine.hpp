@@ -7,6 +7,11 @@
 #include <chrono>
 #include <tuple>
 #include <functional>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <initializer_list>
+#include <new>
 #include "core/logging.hpp"
 #include "consts.hpp"
 #include "error.hpp"
@@ -25,16 +30,138 @@ namespace st {
 		return error_ok;
 	}
 
+	namespace __detail {
+		// The key of the coroutine name, created for each ST thread.
+		inline int name_key() {
+			static thread_local int key = -1;
+			if (key < 0 && st_key_create(&key, NULL) != 0) {
+				key = -1;
+			}
+			return key;
+		}
+
+		// The output gathered by a coroutine, for example a corked TcpConnection, which is
+		// written before the coroutine blocks on others than its socket. It can't be done
+		// by the switch hooks, because writing may switch too.
+		class pending_output {
+		public:
+			virtual ~pending_output() {}
+			virtual void flush_pending() = 0;
+		};
+
+		inline int output_key() {
+			static thread_local int key = -1;
+			if (key < 0 && st_key_create(&key, NULL) != 0) {
+				key = -1;
+			}
+			return key;
+		}
+
+		// Bind the output to the current coroutine, nullptr to unbind.
+		inline void bind_output(pending_output* out) {
+			int key = output_key();
+			if (key >= 0) {
+				st_thread_setspecific(key, out);
+			}
+		}
+
+		// Write the output of the current coroutine, called by the helpers which block.
+		inline void flush_output() {
+			int key = output_key();
+			pending_output* out = key >= 0 ? (pending_output*)st_thread_getspecific(key) : nullptr;
+			if (out) {
+				out->flush_pending();
+			}
+		}
+
+		// The context switch callbacks of the current ST thread. ST keeps only one callback
+		// of each, so the users add theirs here and they are called in order.
+		class switch_hooks {
+		public:
+			static void add(st_switch_cb_t in, st_switch_cb_t out) {
+				hooks& h = get();
+				if (in) {
+					h.ins.push_back(in);
+				}
+				if (out) {
+					h.outs.push_back(out);
+				}
+				install(h);
+			}
+
+			static void remove(st_switch_cb_t in, st_switch_cb_t out) {
+				hooks& h = get();
+				h.ins.erase(std::remove(h.ins.begin(), h.ins.end(), in), h.ins.end());
+				h.outs.erase(std::remove(h.outs.begin(), h.outs.end(), out), h.outs.end());
+				install(h);
+			}
+
+		private:
+			struct hooks {
+				std::vector<st_switch_cb_t> ins;
+				std::vector<st_switch_cb_t> outs;
+			};
+
+			static hooks& get() {
+				static thread_local hooks h;
+				return h;
+			}
+
+			static void install(hooks& h) {
+				st_set_switch_in_cb(h.ins.empty() ? NULL : &switch_hooks::on_switch_in);
+				st_set_switch_out_cb(h.outs.empty() ? NULL : &switch_hooks::on_switch_out);
+			}
+
+			static void on_switch_in() {
+				for (auto cb : get().ins) {
+					cb();
+				}
+			}
+
+			static void on_switch_out() {
+				for (auto cb : get().outs) {
+					cb();
+				}
+			}
+		};
+	}
+
+	namespace this_coroutine {
+		// Name the current coroutine for the profiler and the logs, the name is not copied.
+		inline void set_name(const char* name) {
+			int key = __detail::name_key();
+			if (key >= 0) {
+				st_thread_setspecific(key, (void*)name);
+			}
+		}
+
+		// The name of the current coroutine, nullptr if it's not named.
+		inline const char* name() {
+			int key = __detail::name_key();
+			return key >= 0 ? (const char*)st_thread_getspecific(key) : nullptr;
+		}
+	}
+
 	class coroutine {
 	public:
 		struct _State
 		{
 			virtual ~_State() {}
 			virtual void _M_run() = 0;
+			const char* _M_name = nullptr;
 		};
 
 		using _State_ptr = std::unique_ptr<_State>;
 		typedef st_thread_t	native_handle_type;
+
+		// The attributes to create a coroutine.
+		struct attributes {
+			int joinable = 0;
+			// The stack size in bytes, 0 for the default_stack_size.
+			int stack_size = 0;
+			// The name of the coroutine, see this_coroutine::set_name.
+			const char* name = nullptr;
+		};
 	private:
 		class id
 		{
@@ -59,7 +186,7 @@ namespace st {
 
 	private:
 		id				_M_id;
-		int _M_joinable;
+		int _M_joinable = 0;
 	public:
 		coroutine() noexcept = default;
 
@@ -75,7 +202,7 @@ namespace st {
 		}
 
 		coroutine& operator=(coroutine&& _Other) noexcept {
-			std::swap(_M_id, _Other._M_id);
+			swap(_Other);
 			return *this;
 		}
 
@@ -83,7 +210,59 @@ namespace st {
 		explicit coroutine(int joinable, _Callable&& __f, _Args&&... __args) {
 			// 启动线程
 			_M_joinable = joinable;
-			_M_start_coroutine(_S_make_state(__make_invoker(std::forward<_Callable>(__f), std::forward<_Args>(__args)...)));
+			_M_start_coroutine(_S_make_state(__make_invoker(std::forward<_Callable>(__f), std::forward<_Args>(__args)...)), 0);
+		}
+
+		template< typename _Callable, typename... _Args >
+		explicit coroutine(const attributes& attr, _Callable&& __f, _Args&&... __args) {
+			_M_joinable = attr.joinable;
+			_State_ptr state = _S_make_state(__make_invoker(std::forward<_Callable>(__f), std::forward<_Args>(__args)...));
+			state->_M_name = attr.name;
+			_M_start_coroutine(std::move(state), attr.stack_size);
+		}
+
+		// The stack size for the coroutines without one, 0 for the ST default.
+		static void set_default_stack_size(int size) {
+			_S_default_stack_size() = size;
+		}
+
+		static int default_stack_size() {
+			return _S_default_stack_size();
+		}
+
+		// Round the stack size up to its size class, a power of 2 from 16KB. ST keeps the
+		// stacks of the quit coroutines in a free list and reuses the first one which is
+		// big enough, so the same classes recycle the stacks without mmap/munmap.
+		static int stack_size_class(int size) {
+			if (size <= 0) {
+				return 0;
+			}
+
+			int cls = 16 * 1024;
+			while (cls < size) {
+				cls *= 2;
+			}
+			return cls;
+		}
+
+		// Create the stacks of the size class in the free list of the current ST scheduler,
+		// so the coroutines start later won't allocate them.
+		static void reserve_stacks(int count, int stack_size = 0) {
+			std::vector<native_handle_type> pending;
+			for (int i = 0; i < count; i++) {
+				native_handle_type t = __gthread_coroutine(&_S_noop, nullptr, 1, _S_stack_size(stack_size));
+				if (t == nullptr) {
+					break;
+				}
+				pending.push_back(t);
+			}
+
+			for (auto it : pending) {
+				st_thread_join(it, NULL);
+			}
+
+			// The joined coroutines free their stacks when they run again.
+			st_thread_yield();
 		}
 
 		~coroutine() {
@@ -109,6 +288,7 @@ namespace st {
 		void swap(coroutine& __t) noexcept
 		{
 			std::swap(_M_id, __t._M_id);
+			std::swap(_M_joinable, __t._M_joinable);
 		}
 
 		coroutine::id get_id() const noexcept
@@ -139,9 +319,9 @@ namespace st {
 			return _State_ptr{ new _Impl{std::forward<_Callable>(__f)} };
 		}
 
-		void _M_start_coroutine(_State_ptr state)
+		void _M_start_coroutine(_State_ptr state, int stack_size)
 		{
-			_M_id._M_coroutine = __gthread_coroutine(&execute_native_coroutine_routine, state.get(), _M_joinable, 0);
+			_M_id._M_coroutine = __gthread_coroutine(&execute_native_coroutine_routine, state.get(), _M_joinable, _S_stack_size(stack_size));
 			if (_M_id._M_coroutine == nullptr)
 				throw std::runtime_error("__gthread_coroutine failed");
 			state.release();
@@ -153,11 +333,31 @@ namespace st {
 			return st_thread_create(__func, __args, joinable, stack_size);
 		}
 
+		static std::atomic<int>& _S_default_stack_size() {
+			static std::atomic<int> size{ 0 };
+			return size;
+		}
+
+		static int _S_stack_size(int size) {
+			return stack_size_class(size > 0 ? size : default_stack_size());
+		}
+
+		static void* _S_noop(void*) {
+			return nullptr;
+		}
+
 		// 内部执行线程入口函数
 		static void* execute_native_coroutine_routine(void* __p)
 		{
 			coroutine::_State_ptr __t{ static_cast<coroutine::_State*>(__p) };
+			if (__t->_M_name) {
+				this_coroutine::set_name(__t->_M_name);
+			}
+			__detail::builtin_metrics& m = __detail::builtin_metrics::get();
+			m.coroutines_created.inc();
+			m.coroutines.add(1);
 			__t->_M_run();
+			m.coroutines.sub(1);
 			return nullptr;
 		}
 
@@ -215,6 +415,7 @@ namespace st {
 			if (__rtime <= __rtime.zero())
 				return;
 			auto __mms = std::chrono::duration_cast<std::chrono::microseconds>(__rtime);
+			__detail::flush_output();
 			st_usleep(__mms.count());
 		}
 
@@ -300,6 +501,7 @@ namespace st {
 
 		void wait() noexcept
 		{
+			__detail::flush_output();
 			st_cond_wait(_M_cond);
 		}
 
@@ -374,6 +576,7 @@ namespace st {
 		cv_status
 			__wait_until_impl(const std::chrono::time_point<__clock_t, _Dur>& __atime)
 		{
+			__detail::flush_output();
 			int re = st_cond_timedwait(_M_cond, std::chrono::duration_cast<std::chrono::microseconds>(__atime - __clock_t::now()).count());
 			if (re == -1) {
 				if (errno == ETIME)
@@ -385,4 +588,244 @@ namespace st {
 			return cv_status::no_timeout;
 		}
 	};
+
+	enum class channel_status { ok, closed, timeout, would_block, interrupted };
+
+	class channel_base;
+
+	// A case of select, the op tries to send or receive without blocking.
+	struct select_case {
+		channel_base* ch;
+		std::function<channel_status()> op;
+	};
+
+	// The index of the case which is done or closed, -1 for timeout or interrupted.
+	struct select_result {
+		int index;
+		channel_status status;
+	};
+
+	class channel_base {
+	public:
+		channel_base() = default;
+		channel_base(const channel_base&) = delete;
+		channel_base& operator=(const channel_base&) = delete;
+
+	protected:
+		friend select_result __select_impl(std::initializer_list<select_case>, st_utime_t);
+
+		// Wake the coroutines in select, when an element is sent or received, or closed.
+		void notify_watchers() {
+			for (auto it : watchers_) {
+				it->notify_one();
+			}
+		}
+
+		static st_utime_t remaining(st_utime_t deadline) {
+			if (deadline == ST_UTIME_NO_TIMEOUT) {
+				return ST_UTIME_NO_TIMEOUT;
+			}
+			st_utime_t now = st_utime();
+			return deadline > now ? deadline - now : 0;
+		}
+
+		template<typename _Rep, typename _Period>
+		static st_utime_t deadline_of(const std::chrono::duration<_Rep, _Period>& rtime) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtime).count();
+			return st_utime() + (us > 0 ? (st_utime_t)us : 0);
+		}
+
+		// Wait on the cond until the deadline, return ok to check again.
+		static channel_status wait(condition_variable& cond, st_utime_t deadline) {
+			st_utime_t timeout = remaining(deadline);
+			if (timeout == 0) {
+				return channel_status::timeout;
+			}
+			__detail::flush_output();
+			if (st_cond_timedwait(cond.native_handle(), timeout) == -1 && errno != ETIME) {
+				return channel_status::interrupted;
+			}
+			return channel_status::ok;
+		}
+
+	private:
+		std::vector<condition_variable*> watchers_;
+	};
+
+	// The bounded channel of the coroutines in one ST thread, like the buffered channel
+	// of Go. The elements are moved into a ring, the senders wait when it's full and the
+	// receivers wait when it's empty. After close, the senders fail and the receivers get
+	// the remaining elements, then fail.
+	template<typename T>
+	class channel :public channel_base {
+	public:
+		// @param capacity, the max buffered elements, at least 1.
+		explicit channel(size_t capacity) {
+			cap_ = capacity > 0 ? capacity : 1;
+			buf_ = std::allocator<T>().allocate(cap_);
+		}
+
+		~channel() {
+			while (count_ > 0) {
+				buf_[head_].~T();
+				head_ = (head_ + 1) % cap_;
+				count_--;
+			}
+			std::allocator<T>().deallocate(buf_, cap_);
+		}
+
+		size_t capacity() const { return cap_; }
+		size_t size() const { return count_; }
+		bool closed() const { return closed_; }
+
+		// Wake all senders and receivers.
+		void close() {
+			closed_ = true;
+			not_empty_.notify_all();
+			not_full_.notify_all();
+			notify_watchers();
+		}
+
+		// The value is moved only when it's sent.
+		channel_status try_send(T&& v) {
+			if (closed_) {
+				return channel_status::closed;
+			}
+			if (count_ == cap_) {
+				return channel_status::would_block;
+			}
+			push(std::move(v));
+			return channel_status::ok;
+		}
+
+		channel_status try_recv(T& v) {
+			if (count_ == 0) {
+				return closed_ ? channel_status::closed : channel_status::would_block;
+			}
+			pop(v);
+			return channel_status::ok;
+		}
+
+		channel_status send(T&& v) {
+			return send_until(std::move(v), ST_UTIME_NO_TIMEOUT);
+		}
+
+		channel_status send(const T& v) {
+			return send_until(T(v), ST_UTIME_NO_TIMEOUT);
+		}
+
+		template<typename _Rep, typename _Period>
+		channel_status send_for(T&& v, const std::chrono::duration<_Rep, _Period>& rtime) {
+			return send_until(std::move(v), deadline_of(rtime));
+		}
+
+		channel_status recv(T& v) {
+			return recv_until(v, ST_UTIME_NO_TIMEOUT);
+		}
+
+		template<typename _Rep, typename _Period>
+		channel_status recv_for(T& v, const std::chrono::duration<_Rep, _Period>& rtime) {
+			return recv_until(v, deadline_of(rtime));
+		}
+
+		// The cases of select, the value is moved only when it's sent.
+		select_case send_case(T& v) {
+			return select_case{ this, [this, &v]() { return try_send(std::move(v)); } };
+		}
+
+		select_case recv_case(T& v) {
+			return select_case{ this, [this, &v]() { return try_recv(v); } };
+		}
+
+	private:
+		channel_status send_until(T&& v, st_utime_t deadline) {
+			while (!closed_ && count_ == cap_) {
+				channel_status s = wait(not_full_, deadline);
+				if (s != channel_status::ok) {
+					return s;
+				}
+			}
+			return try_send(std::move(v));
+		}
+
+		channel_status recv_until(T& v, st_utime_t deadline) {
+			while (!closed_ && count_ == 0) {
+				channel_status s = wait(not_empty_, deadline);
+				if (s != channel_status::ok) {
+					return s;
+				}
+			}
+			return try_recv(v);
+		}
+
+		void push(T&& v) {
+			new (&buf_[(head_ + count_) % cap_]) T(std::move(v));
+			count_++;
+			not_empty_.notify_one();
+			notify_watchers();
+		}
+
+		void pop(T& v) {
+			v = std::move(buf_[head_]);
+			buf_[head_].~T();
+			head_ = (head_ + 1) % cap_;
+			count_--;
+			not_full_.notify_one();
+			notify_watchers();
+		}
+
+	private:
+		T* buf_;
+		size_t cap_;
+		size_t head_ = 0;
+		size_t count_ = 0;
+		bool closed_ = false;
+		condition_variable not_empty_;
+		condition_variable not_full_;
+	};
+
+	inline select_result __select_impl(std::initializer_list<select_case> cases, st_utime_t deadline) {
+		// Start from the next case each time, so a busy channel doesn't starve the others.
+		static thread_local unsigned int next = 0;
+		int n = (int)cases.size();
+		int start = n > 0 ? (int)(next++ % n) : 0;
+
+		condition_variable cond;
+		while (true) {
+			for (int k = 0; k < n; k++) {
+				int i = (start + k) % n;
+				channel_status s = cases.begin()[i].op();
+				if (s == channel_status::ok || s == channel_status::closed) {
+					return select_result{ i, s };
+				}
+			}
+
+			for (auto& it : cases) {
+				it.ch->watchers_.push_back(&cond);
+			}
+			channel_status s = channel_base::wait(cond, deadline);
+			for (auto& it : cases) {
+				auto& w = it.ch->watchers_;
+				w.erase(std::find(w.begin(), w.end(), &cond));
+			}
+
+			if (s != channel_status::ok) {
+				return select_result{ -1, s };
+			}
+		}
+	}
+
+	// Wait until one of the cases is done or its channel is closed, the cases are tried
+	// in turn, for example:
+	//      int v; std::string s;
+	//      auto r = st::select({ ch1.recv_case(v), ch2.recv_case(s) });
+	inline select_result select(std::initializer_list<select_case> cases) {
+		return __select_impl(cases, ST_UTIME_NO_TIMEOUT);
+	}
+
+	template<typename _Rep, typename _Period>
+	inline select_result select_for(std::initializer_list<select_case> cases, const std::chrono::duration<_Rep, _Period>& rtime) {
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtime).count();
+		return __select_impl(cases, st_utime() + (us > 0 ? (st_utime_t)us : 0));
+	}
 }
\ No newline at end of file
@@ -1,24 +1,89 @@
 #pragma once
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <cstring>
 #include <cstdarg>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <cstddef>
 #include "consts.hpp"
+#include "metrics.hpp"
 
 
 #ifndef __FILENAME__
 	#define __FILENAME__ (strrchr(__FILE__, '/') ? (strrchr(__FILE__, '/') + 1):__FILE__)
 #endif
 
+// The max frames traced by an error, the frames after it are counted only.
+#define ERROR_MAX_FRAMES 16
+// The max format args captured by an error, formatted immediately when exceed.
+#define ERROR_MAX_ARGS 8
+// The bytes for the captured string args, or the desc formatted immediately, a longer
+// desc is formatted to the heap.
+#define ERROR_TEXT_SIZE 256
+// The max free errors cached by each thread.
+#define ERROR_POOL_SIZE 64
+
 namespace st {
 	class __merror;
-	typedef std::shared_ptr<__merror> error_t;
 
+	// The intrusive pointer to an error, nullptr for success.
+	// @remark The reference count is not atomic, an error is owned by one thread at
+	//		a time, which may hand it over to another thread by moving the only reference,
+	//		never by a copy while its own references are alive.
+	class error_t {
+	public:
+		error_t() noexcept :ptr_(nullptr) {}
+		error_t(std::nullptr_t) noexcept :ptr_(nullptr) {}
+		// Take the reference of p.
+		explicit error_t(__merror* p) noexcept :ptr_(p) {}
+		inline error_t(const error_t& other) noexcept;
+		error_t(error_t&& other) noexcept :ptr_(other.ptr_) { other.ptr_ = nullptr; }
+		inline ~error_t();
+
+		inline error_t& operator=(const error_t& other) noexcept;
+
+		// Take the pointer of other before the old one is released, so the released
+		// record is never touched again.
+		error_t& operator=(error_t&& other) noexcept {
+			if (this != &other) {
+				__merror* old = ptr_;
+				ptr_ = other.ptr_;
+				other.ptr_ = nullptr;
+				unref(old);
+			}
+			return *this;
+		}
+
+		void swap(error_t& other) noexcept { std::swap(ptr_, other.ptr_); }
+
+		__merror* get() const noexcept { return ptr_; }
+		__merror* operator->() const noexcept { return ptr_; }
+		__merror& operator*() const noexcept { return *ptr_; }
+		explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+		friend bool operator==(const error_t& x, const error_t& y) noexcept { return x.ptr_ == y.ptr_; }
+		friend bool operator!=(const error_t& x, const error_t& y) noexcept { return x.ptr_ != y.ptr_; }
+		friend bool operator==(const error_t& x, std::nullptr_t) noexcept { return x.ptr_ == nullptr; }
+		friend bool operator!=(const error_t& x, std::nullptr_t) noexcept { return x.ptr_ != nullptr; }
+
+	private:
+		static inline void unref(__merror* p) noexcept;
+
+	private:
+		__merror* ptr_;
+	};
+
+	// The error record, which is taken from a per thread pool. The file and function of
+	// the frames are the literals of the macros, and the format args are captured by
+	// value, so creating and tracing an error costs a few writes, the desc is formatted
+	// only by what() or desc().
 	class __merror{
 	public:
-		~__merror() { stacks_.clear(); }
 		__merror(const __merror&) = delete;
 		__merror(__merror&&) = delete;
 		__merror& operator=(const __merror&) = delete;
@@ -27,73 +92,410 @@ namespace st {
 		static error_t make_ok() {
 			return error_t(nullptr);
 		}
-		
-		static error_t make_error(const std::string& file, int line, const std::string& fun, int code, const char* fmt, ...) {
+
+		static error_t make_error(const char* file, int line, const char* fun, int code, const char* fmt, ...)
+#ifdef __GNUC__
+			__attribute__((format(printf, 5, 6)))
+#endif
+		{
+			__merror* err = alloc();
+			err->rerrno_ = (int)errno;
+			err->code_ = code;
+			err->nframes_ = 0;
+			err->nskipped_ = 0;
+
 			va_list ap;
 			va_start(ap, fmt);
-			static char buffer[4096];
-			vsnprintf(buffer, sizeof(buffer), fmt, ap);
+			err->capture(fmt, ap);
 			va_end(ap);
-			return error_t(new __merror(file, line, fun, code, std::string(buffer)));
+
+			err->append(file, line, fun);
+			MetricsRegistry::instance().count_error(code);
+			return error_t(err);
 		}
 
-		static error_t append(error_t err, const std::string& file, int line, const std::string& fun) {
-			err->append(file,line,fun);
+		static error_t append(const error_t& err, const char* file, int line, const char* fun) {
+			if (err) {
+				err->append(file, line, fun);
+			}
 			return err;
 		}
 
+		// Fill the pool of the current thread, for the threads which hit errors in the hot path.
+		static void reserve(int n) {
+			for (int i = 0; i < n && pool().size < ERROR_POOL_SIZE; i++) {
+				release(new __merror());
+			}
+		}
+
 		int code() const {
 			return code_;
 		}
 
+		// The errno when the error is created.
+		int rerrno() const {
+			return rerrno_;
+		}
+
 		std::string desc() const {
-			return desc_;
+			if (!fmt_) {
+				return long_text_.empty() ? std::string(text_) : long_text_;
+			}
+
+			std::string desc;
+			format(desc);
+			return desc;
 		}
-			
+
 		std::string what() const {
 			std::stringstream ss;
-			ss << "error no:" << code_ << ",desc:" << desc_  << '\n';
-			int num = stacks_.size();
+			ss << "error no:" << code_ << ",desc:" << desc() << '\n';
+			int num = nframes_;
 			int index = 0;
-			for (auto it = stacks_.rbegin(); it!= stacks_.rend();it++,index++) {
-				for (int i = 0; i < index; i++) {
+			for (int i = num - 1; i >= 0; i--, index++) {
+				for (int j = 0; j < index; j++) {
 					ss << "  ";
 				}
-				ss << "->" << it->file << ":" << it->line << " [" << it->fun << "]";
+				const char* file = strrchr(frames_[i].file, '/');
+				ss << "->" << (file ? file + 1 : frames_[i].file) << ":" << frames_[i].line << " [" << frames_[i].fun << "]";
 				if (index < num - 1)
 					ss << '\n';
 			}
+			if (nskipped_ > 0) {
+				ss << "\n(" << nskipped_ << " more frames)";
+			}
 			return ss.str();
 		}
 
 	private:
+		friend class error_t;
 		__merror() = default;
-		__merror(const std::string& file, int line, const std::string& fun,int codec, const std::string& desc) {
-			rerrno_ = (int)errno;
-			code_ = codec;
-			desc_ = desc;
-			append(file, line, fun);
+
+		void append(const char* file, int line, const char* fun) {
+			if (nframes_ >= ERROR_MAX_FRAMES) {
+				nskipped_++;
+				return;
+			}
+			frames_[nframes_++] = frame{ file, line, fun };
+		}
+
+	private:
+		// The conversion of a captured arg.
+		enum arg_type { ARG_SIGNED, ARG_UNSIGNED, ARG_DOUBLE, ARG_POINTER, ARG_STRING };
+
+		union arg_value {
+			long long i;
+			unsigned long long u;
+			double d;
+			const void* p;
+			size_t s;
+		};
+
+		// Capture the args by the conversions of fmt, or format it now if fmt is beyond
+		// what we capture, for example the * width or too many args.
+		void capture(const char* fmt, va_list ap) {
+			fmt_ = fmt;
+			nargs_ = 0;
+			long_text_.clear();
+			size_t ntext = 0;
+
+			va_list aq;
+			va_copy(aq, ap);
+			for (const char* p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+				p++;
+				if (*p == '%') {
+					p++;
+					continue;
+				}
+
+				// The flags, width and precision.
+				p += strspn(p, "-+ #0123456789.");
+				int longs = 0;
+				char size = 0;
+				for (; *p == 'l' || *p == 'h' || *p == 'z' || *p == 'j' || *p == 't'; p++) {
+					if (*p == 'l') {
+						longs++;
+					}
+					else if (*p != 'h') {
+						size = *p;
+					}
+				}
+
+				if (nargs_ >= ERROR_MAX_ARGS) {
+					fmt_ = nullptr;
+					break;
+				}
+
+				arg_value& v = args_[nargs_];
+				arg_type& t = types_[nargs_++];
+				switch (*p) {
+				case 'd': case 'i': case 'c':
+					t = ARG_SIGNED;
+					if (size == 'z') v.i = va_arg(aq, ssize_t);
+					else if (size == 'j') v.i = va_arg(aq, intmax_t);
+					else if (size == 't') v.i = va_arg(aq, ptrdiff_t);
+					else if (longs >= 2) v.i = va_arg(aq, long long);
+					else if (longs == 1) v.i = va_arg(aq, long);
+					else v.i = va_arg(aq, int);
+					break;
+				case 'u': case 'x': case 'X': case 'o':
+					t = ARG_UNSIGNED;
+					if (size == 'z') v.u = va_arg(aq, size_t);
+					else if (size == 'j') v.u = va_arg(aq, uintmax_t);
+					else if (size == 't') v.u = va_arg(aq, ptrdiff_t);
+					else if (longs >= 2) v.u = va_arg(aq, unsigned long long);
+					else if (longs == 1) v.u = va_arg(aq, unsigned long);
+					else v.u = va_arg(aq, unsigned int);
+					break;
+				case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+					t = ARG_DOUBLE;
+					v.d = va_arg(aq, double);
+					break;
+				case 'p':
+					t = ARG_POINTER;
+					v.p = va_arg(aq, void*);
+					break;
+				case 's': {
+					// The string may be a temporary, so copy it.
+					t = ARG_STRING;
+					const char* s = va_arg(aq, const char*);
+					s = s ? s : "(null)";
+					size_t n = strlen(s);
+					// Format now when it doesn't fit, so the string is never cut.
+					if (n >= sizeof(text_) - ntext) {
+						fmt_ = nullptr;
+						break;
+					}
+					memcpy(text_ + ntext, s, n);
+					text_[ntext + n] = '\0';
+					v.s = ntext;
+					ntext += n + 1;
+					if (ntext >= sizeof(text_)) {
+						ntext = sizeof(text_) - 1;
+					}
+					break;
+				}
+				default:
+					fmt_ = nullptr;
+					break;
+				}
+
+				if (!fmt_) {
+					break;
+				}
+			}
+			va_end(aq);
+
+			if (!fmt_) {
+				va_list aq2;
+				va_copy(aq2, ap);
+				int n = vsnprintf(text_, sizeof(text_), fmt, ap);
+				if (n >= (int)sizeof(text_)) {
+					long_text_.resize(n + 1);
+					vsnprintf(&long_text_[0], n + 1, fmt, aq2);
+					long_text_.resize(n);
+				}
+				va_end(aq2);
+			}
+		}
+
+		// Format fmt_ with the captured args to out.
+		void format(std::string& out) const {
+			char spec[32];
+			int index = 0;
+			const char* p = fmt_;
+			while (*p) {
+				const char* pct = strchr(p, '%');
+				if (!pct) {
+					out.append(p);
+					break;
+				}
+				out.append(p, pct - p);
+				p = pct + 1;
+				if (*p == '%') {
+					out.push_back('%');
+					p++;
+					continue;
+				}
+
+				// Rewrite the conversion without length, use the long long for integers.
+				size_t nflags = strspn(p, "-+ #0123456789.");
+				nflags = std::min(nflags, sizeof(spec) - 5);
+				spec[0] = '%';
+				memcpy(spec + 1, p, nflags);
+				p += nflags;
+				p += strspn(p, "lhzjt");
+				char conv = *p ? *p++ : 's';
+				size_t n = 1 + nflags;
+
+				const arg_value& v = args_[index];
+				switch (types_[index++]) {
+				case ARG_SIGNED:
+					if (conv != 'c') {
+						spec[n++] = 'l';
+						spec[n++] = 'l';
+					}
+					spec[n++] = conv;
+					spec[n] = '\0';
+					append_arg(out, spec, v.i);
+					break;
+				case ARG_UNSIGNED:
+					spec[n++] = 'l';
+					spec[n++] = 'l';
+					spec[n++] = conv;
+					spec[n] = '\0';
+					append_arg(out, spec, v.u);
+					break;
+				case ARG_DOUBLE:
+					spec[n++] = conv;
+					spec[n] = '\0';
+					append_arg(out, spec, v.d);
+					break;
+				case ARG_POINTER:
+					spec[n++] = conv;
+					spec[n] = '\0';
+					append_arg(out, spec, v.p);
+					break;
+				case ARG_STRING:
+					spec[n++] = conv;
+					spec[n] = '\0';
+					append_arg(out, spec, text_ + v.s);
+					break;
+				}
+			}
+		}
+
+		// Append the conversion of v by spec, without cutting it.
+		template<typename T>
+		static void append_arg(std::string& out, const char* spec, T v) {
+			char buf[128];
+			int n = snprintf(buf, sizeof(buf), spec, v);
+			if (n < 0) {
+				return;
+			}
+			if (n < (int)sizeof(buf)) {
+				out.append(buf, n);
+				return;
+			}
+
+			size_t off = out.size();
+			out.resize(off + n + 1);
+			snprintf(&out[off], n + 1, spec, v);
+			out.resize(off + n);
+		}
+
+	private:
+		// The free errors of the current thread.
+		struct error_pool {
+			__merror* head = nullptr;
+			int size = 0;
+			~error_pool() {
+				while (head) {
+					__merror* err = head;
+					head = err->next_;
+					delete err;
+				}
+				disabled() = true;
+			}
+		};
+
+		static error_pool& pool() {
+			static thread_local error_pool p;
+			return p;
+		}
+
+		// Set when the pool of the thread is destroyed.
+		static bool& disabled() {
+			static thread_local bool d = false;
+			return d;
 		}
 
-		void append(const std::string& file, int line, const std::string& fun) {
-			stacks_.emplace_back(file,line,fun);
+		static __merror* alloc() {
+			if (disabled()) {
+				return new __merror();
+			}
+
+			error_pool& p = pool();
+			__merror* err = p.head;
+			if (err) {
+				p.head = err->next_;
+				p.size--;
+				err->refs_ = 1;
+				return err;
+			}
+
+			err = new __merror();
+			err->refs_ = 1;
+			return err;
 		}
+
+		static void release(__merror* err) {
+			if (disabled()) {
+				delete err;
+				return;
+			}
+
+			error_pool& p = pool();
+			if (p.size >= ERROR_POOL_SIZE) {
+				delete err;
+				return;
+			}
+			err->next_ = p.head;
+			p.head = err;
+			p.size++;
+		}
+
 	private:
-		struct __merroritem {
-			std::string file;
+		struct frame {
+			const char* file;
 			int         line;
-			std::string fun;
-			__merroritem(const std::string& filev, int linev, const std::string& funv):file(filev),line(linev),fun(funv) {}
+			const char* fun;
 		};
 
-		int code_;
-		int rerrno_;
-		std::string desc_;
-		std::vector<__merroritem> stacks_;
+		int refs_ = 0;
+		int code_ = 0;
+		int rerrno_ = 0;
+		// The format of desc, nullptr if the desc is formatted to text_.
+		const char* fmt_ = nullptr;
+		int nargs_ = 0;
+		arg_type types_[ERROR_MAX_ARGS];
+		arg_value args_[ERROR_MAX_ARGS];
+		char text_[ERROR_TEXT_SIZE];
+		// The desc formatted when it doesn't fit in text_.
+		std::string long_text_;
+		int nframes_ = 0;
+		int nskipped_ = 0;
+		frame frames_[ERROR_MAX_FRAMES];
+		__merror* next_ = nullptr;
 	};
 
+	inline error_t::error_t(const error_t& other) noexcept :ptr_(other.ptr_) {
+		if (ptr_) {
+			ptr_->refs_++;
+		}
+	}
+
+	inline error_t& error_t::operator=(const error_t& other) noexcept {
+		if (other.ptr_) {
+			other.ptr_->refs_++;
+		}
+		__merror* old = ptr_;
+		ptr_ = other.ptr_;
+		unref(old);
+		return *this;
+	}
+
+	inline void error_t::unref(__merror* p) noexcept {
+		if (p && --p->refs_ == 0) {
+			__merror::release(p);
+		}
+	}
+
+	inline error_t::~error_t() {
+		unref(ptr_);
+	}
 }
 
-#define error_new(code, fmt, ...) st::__merror::make_error(__FILENAME__, __LINE__, __FUNCTION__, code, fmt, ##__VA_ARGS__)
-#define error_trace(err) st::__merror::append(err,__FILENAME__, __LINE__, __FUNCTION__)
-#define error_ok st::__merror::make_ok() 
\ No newline at end of file
+#define error_new(code, fmt, ...) st::__merror::make_error(__FILE__, __LINE__, __FUNCTION__, code, fmt, ##__VA_ARGS__)
+#define error_trace(err) st::__merror::append(err, __FILE__, __LINE__, __FUNCTION__)
+#define error_ok st::__merror::make_ok()
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+namespace st {
+	// The log-linear histogram like HdrHistogram, the values under 128 are exact and each
+	// power of 2 above is split to 64 buckets, so the error is under 1/64 of the value.
+	// Recording is a few instructions without allocation, and the histograms of the threads
+	// can be merged.
+	class Histogram {
+	public:
+		Histogram() :counts_(SUB_BUCKETS + MAX_SHIFT * HALF_BUCKETS, 0) {
+			reset();
+		}
+
+		void reset() {
+			std::fill(counts_.begin(), counts_.end(), 0);
+			count_ = 0;
+			sum_ = 0;
+			min_ = INT64_MAX;
+			max_ = 0;
+		}
+
+		// Record a value, the negative ones are taken as 0.
+		void record(int64_t v, uint64_t n = 1) {
+			if (v < 0) {
+				v = 0;
+			}
+			counts_[index_of(v)] += n;
+			count_ += n;
+			sum_ += (double)v * n;
+			min_ = std::min(min_, v);
+			max_ = std::max(max_, v);
+		}
+
+		void merge(const Histogram& o) {
+			for (size_t i = 0; i < counts_.size(); i++) {
+				counts_[i] += o.counts_[i];
+			}
+			count_ += o.count_;
+			sum_ += o.sum_;
+			min_ = std::min(min_, o.min_);
+			max_ = std::max(max_, o.max_);
+		}
+
+		uint64_t count() const { return count_; }
+		int64_t min() const { return count_ ? min_ : 0; }
+		int64_t max() const { return max_; }
+		double mean() const { return count_ ? sum_ / count_ : 0; }
+
+		// The value at the percentile in [0, 100], which is the highest value of its bucket.
+		int64_t percentile(double p) const {
+			if (count_ == 0) {
+				return 0;
+			}
+
+			uint64_t target = (uint64_t)(p / 100 * count_ + 0.5);
+			target = std::max<uint64_t>(1, std::min(target, count_));
+
+			uint64_t seen = 0;
+			for (size_t i = 0; i < counts_.size(); i++) {
+				seen += counts_[i];
+				if (seen >= target) {
+					return std::min(highest_of((int)i), max_);
+				}
+			}
+			return max_;
+		}
+
+	private:
+		static const int SUB_BUCKETS = 128;
+		static const int HALF_BUCKETS = 64;
+		// The values under 2^63, the top 7 bits select the bucket.
+		static const int MAX_SHIFT = 57;
+
+		static int index_of(int64_t v) {
+			if (v < SUB_BUCKETS) {
+				return (int)v;
+			}
+			int shift = (63 - __builtin_clzll((uint64_t)v)) - 6;
+			int sub = (int)(v >> shift);
+			return SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + (sub - HALF_BUCKETS);
+		}
+
+		static int64_t highest_of(int index) {
+			if (index < SUB_BUCKETS) {
+				return index;
+			}
+			int shift = (index - SUB_BUCKETS) / HALF_BUCKETS + 1;
+			uint64_t sub = (index - SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS;
+			return (int64_t)(((sub + 1) << shift) - 1);
+		}
+
+	private:
+		std::vector<uint64_t> counts_;
+		uint64_t count_;
+		double sum_;
+		int64_t min_;
+		int64_t max_;
+	};
+}
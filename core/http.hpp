@@ -0,0 +1,502 @@
+#pragma once
+#include <strings.h>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "net.hpp"
+
+// The max bytes of the request line and the headers.
+#define HTTP_MAX_HEADER_SIZE (64 * 1024)
+// The max headers of a request, the rest fail the request.
+#define HTTP_MAX_HEADERS 64
+// The max bytes of a request body, the framed request is kept in the connection buffer.
+#define HTTP_MAX_BODY_SIZE (CONNECTION_MAX_BUFFER_SIZE - HTTP_MAX_HEADER_SIZE)
+// The response body under it is copied after the head and written as one message, which
+// is gathered with the other responses when the connection is corked.
+#define HTTP_COPY_BODY_SIZE 4096
+
+namespace st {
+	namespace __detail {
+		inline bool http_iequals(std::string_view a, std::string_view b) {
+			return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+		}
+
+		inline std::string_view http_trim(std::string_view v) {
+			while (!v.empty() && (v.front() == ' ' || v.front() == '\t')) {
+				v.remove_prefix(1);
+			}
+			while (!v.empty() && (v.back() == ' ' || v.back() == '\t')) {
+				v.remove_suffix(1);
+			}
+			return v;
+		}
+
+		// Whether the last coding of the transfer-encoding is chunked.
+		inline bool http_is_chunked(std::string_view v) {
+			size_t pos = v.rfind(',');
+			return http_iequals(http_trim(pos == std::string_view::npos ? v : v.substr(pos + 1)), "chunked");
+		}
+
+		// Parse the decimal content-length, false if invalid, which stops growing once it
+		// exceeds HTTP_MAX_BODY_SIZE.
+		inline bool http_parse_length(std::string_view v, uint64_t* n) {
+			if (v.empty()) {
+				return false;
+			}
+			*n = 0;
+			for (char c : v) {
+				if (c < '0' || c > '9') {
+					return false;
+				}
+				if (*n <= HTTP_MAX_BODY_SIZE) {
+					*n = *n * 10 + (c - '0');
+				}
+			}
+			return true;
+		}
+
+		// Walk the chunked body at the head of v, see RFC 7230 4.1.
+		// @param size, the bytes of the chunks and the trailers, 0 if incomplete.
+		// @param body, the data of the chunks is appended to it, ignore if NULL.
+		// @param need, the bytes v needs at least when incomplete, 0 if unknown, ignore if NULL.
+		inline error_t http_chunks(std::string_view v, size_t* size, std::string* body, size_t* need = NULL) {
+			*size = 0;
+			if (need) {
+				*need = 0;
+			}
+			size_t pos = 0;
+			uint64_t total = 0;
+			while (true) {
+				size_t eol = v.find("\r\n", pos);
+				if (eol == std::string_view::npos) {
+					if (v.size() - pos > HTTP_MAX_HEADER_SIZE) {
+						return error_new(ERROR_READER_BUFFER_OVERFLOW, "chunk line exceed %d", HTTP_MAX_HEADER_SIZE);
+					}
+					return error_ok;
+				}
+
+				// The hex size, with the optional extensions after ';'.
+				uint64_t chunk = 0;
+				size_t i = pos;
+				for (; i < eol; i++) {
+					char c = v[i];
+					int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+					if (d < 0) {
+						break;
+					}
+					chunk = chunk * 16 + d;
+					if (chunk > HTTP_MAX_BODY_SIZE) {
+						return error_new(ERROR_READER_BUFFER_OVERFLOW, "chunk exceed %d", (int)HTTP_MAX_BODY_SIZE);
+					}
+				}
+				if (i == pos || (i < eol && v[i] != ';' && v[i] != ' ' && v[i] != '\t')) {
+					return error_new(ERROR_SYSTEM_PACKET_INVALID, "invalid chunk size");
+				}
+				pos = eol + 2;
+
+				// The last chunk, then the trailers end by an empty line.
+				if (chunk == 0) {
+					while (true) {
+						eol = v.find("\r\n", pos);
+						if (eol == std::string_view::npos) {
+							return error_ok;
+						}
+						bool empty = eol == pos;
+						pos = eol + 2;
+						if (empty) {
+							*size = pos;
+							return error_ok;
+						}
+					}
+				}
+
+				if (v.size() - pos < chunk + 2) {
+					if (need) {
+						*need = pos + chunk + 2;
+					}
+					return error_ok;
+				}
+				if (v[pos + chunk] != '\r' || v[pos + chunk + 1] != '\n') {
+					return error_new(ERROR_SYSTEM_PACKET_INVALID, "invalid chunk end");
+				}
+				if ((total += chunk) > HTTP_MAX_BODY_SIZE) {
+					return error_new(ERROR_READER_BUFFER_OVERFLOW, "body exceed %d", (int)HTTP_MAX_BODY_SIZE);
+				}
+				if (body) {
+					body->append(v.data() + pos, chunk);
+				}
+				pos += chunk + 2;
+			}
+		}
+
+		// Skip the empty lines before a request, see RFC 7230 3.5.
+		inline size_t http_skip_crlf(std::string_view v) {
+			size_t pos = 0;
+			while (pos < v.size() && (v[pos] == '\r' || v[pos] == '\n')) {
+				pos++;
+			}
+			return pos;
+		}
+	}
+
+	struct HttpHeader {
+		std::string_view name;
+		std::string_view value;
+	};
+
+	// The HTTP/1.1 request framing, every complete request in the buffer is passed to the
+	// handler as one message, with the headers and the body, so the pipelined requests are
+	// decoded by one read. Parse the message by HttpRequest.
+	// @remark It's stateless and shared by the connections, so a partial request is scanned
+	//		again from its head. The frame_size_hint tells the connection to read the whole
+	//		body, or the whole chunk it waits for, before that, so a body is scanned once,
+	//		and a chunked body is walked again by the chunk sizes once per chunk.
+	class HttpCodec :public IStreamCodec {
+	public:
+		virtual error_t decode(const char* data, size_t len, size_t* nconsumed, const MessageHandler& handler) override {
+			error_t err;
+			size_t pos = 0;
+			while (true) {
+				pos += __detail::http_skip_crlf(std::string_view(data + pos, len - pos));
+				if (pos == len) {
+					break;
+				}
+
+				size_t size = 0;
+				size_t need = 0;
+				if ((err = frame(std::string_view(data + pos, len - pos), &size, &need)) != error_ok) {
+					return error_trace(err);
+				}
+				if (size == 0) {
+					break;
+				}
+				handler(std::string_view(data + pos, size));
+				pos += size;
+			}
+			*nconsumed = pos;
+			return err;
+		}
+
+		// The bytes of the partial request, the headers and the body of content-length, or
+		// the chunks till the end of the chunk it waits for.
+		virtual size_t frame_size_hint(const char* data, size_t len) override {
+			std::string_view v(data, len);
+			size_t pos = __detail::http_skip_crlf(v);
+			size_t size = 0;
+			size_t need = 0;
+			error_t err = frame(v.substr(pos), &size, &need);
+			if (err || size || !need) {
+				return 0;
+			}
+			return pos + need;
+		}
+
+		// The responses are formatted by HttpResponse, which are written as is.
+		virtual error_t encode(const void* data, size_t len, IovecList& out) override {
+			out.append(data, len);
+			return error_ok;
+		}
+
+	private:
+		// The bytes of the request at the head of v, 0 if incomplete.
+		// @param need, the bytes the incomplete request needs at least, 0 if unknown.
+		static error_t frame(std::string_view v, size_t* size, size_t* need) {
+			*size = 0;
+			*need = 0;
+			size_t end = v.find("\r\n\r\n");
+			if (end == std::string_view::npos) {
+				if (v.size() > HTTP_MAX_HEADER_SIZE) {
+					return error_new(ERROR_READER_BUFFER_OVERFLOW, "header exceed %d", HTTP_MAX_HEADER_SIZE);
+				}
+				return error_ok;
+			}
+			size_t header_size = end + 4;
+			if (header_size > HTTP_MAX_HEADER_SIZE) {
+				return error_new(ERROR_READER_BUFFER_OVERFLOW, "header %d exceed %d", (int)header_size, HTTP_MAX_HEADER_SIZE);
+			}
+
+			// Only the framing headers, the others are parsed by HttpRequest. The ambiguous
+			// framing is rejected, which smuggles a request, see RFC 7230 3.3.3.
+			uint64_t content_length = 0;
+			bool has_length = false;
+			bool chunked = false;
+			bool has_encoding = false;
+			for (size_t pos = v.find("\r\n") + 2; pos < end;) {
+				size_t eol = v.find("\r\n", pos);
+				std::string_view line = v.substr(pos, eol - pos);
+				pos = eol + 2;
+
+				size_t colon = line.find(':');
+				if (colon == std::string_view::npos) {
+					continue;
+				}
+				std::string_view name = line.substr(0, colon);
+				std::string_view value = __detail::http_trim(line.substr(colon + 1));
+				if (__detail::http_iequals(name, "content-length")) {
+					uint64_t length = 0;
+					if (!__detail::http_parse_length(value, &length)) {
+						return error_new(ERROR_SYSTEM_PACKET_INVALID, "invalid content-length %s", std::string(value).c_str());
+					}
+					if (has_length && length != content_length) {
+						return error_new(ERROR_SYSTEM_PACKET_INVALID, "conflicting content-length %llu and %llu", (unsigned long long)content_length, (unsigned long long)length);
+					}
+					if (length > HTTP_MAX_BODY_SIZE) {
+						return error_new(ERROR_READER_BUFFER_OVERFLOW, "body %llu exceed %d", (unsigned long long)length, (int)HTTP_MAX_BODY_SIZE);
+					}
+					content_length = length;
+					has_length = true;
+				}
+				else if (__detail::http_iequals(name, "transfer-encoding")) {
+					// The codings of the repeated headers are one list, the last is the final.
+					chunked = __detail::http_is_chunked(value);
+					has_encoding = true;
+				}
+			}
+
+			if (has_encoding && has_length) {
+				return error_new(ERROR_SYSTEM_PACKET_INVALID, "both transfer-encoding and content-length");
+			}
+			if (has_encoding && !chunked) {
+				return error_new(ERROR_SYSTEM_PACKET_INVALID, "the final transfer-coding is not chunked");
+			}
+
+			if (chunked) {
+				error_t err;
+				size_t n = 0;
+				size_t rest = 0;
+				if ((err = __detail::http_chunks(v.substr(header_size), &n, NULL, &rest)) != error_ok) {
+					return error_trace(err);
+				}
+				*size = n ? header_size + n : 0;
+				*need = rest ? header_size + rest : 0;
+				return err;
+			}
+
+			if (v.size() - header_size >= content_length) {
+				*size = header_size + content_length;
+			}
+			else {
+				*need = header_size + content_length;
+			}
+			return error_ok;
+		}
+	};
+
+	// The request framed by HttpCodec, the fields are views into the message, so it's only
+	// valid in the handler, except the chunked body which is joined into the request.
+	class HttpRequest {
+	public:
+		HttpRequest() {}
+
+		HttpRequest(const HttpRequest&) = delete;
+		HttpRequest& operator=(const HttpRequest&) = delete;
+
+		error_t parse(std::string_view msg) {
+			msg.remove_prefix(__detail::http_skip_crlf(msg));
+			nb_headers_ = 0;
+			chunked_ = false;
+			chunked_body_.clear();
+
+			// For example, GET /index.html?a=1 HTTP/1.1
+			size_t eol = msg.find("\r\n");
+			if (eol == std::string_view::npos) {
+				return error_new(ERROR_SYSTEM_PACKET_INVALID, "no request line");
+			}
+			std::string_view line = msg.substr(0, eol);
+			size_t sp1 = line.find(' ');
+			size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+			if (sp2 == std::string_view::npos || sp1 == 0 || sp2 == sp1 + 1) {
+				return error_new(ERROR_SYSTEM_PACKET_INVALID, "invalid request line");
+			}
+			method_ = line.substr(0, sp1);
+			target_ = line.substr(sp1 + 1, sp2 - sp1 - 1);
+			version_ = line.substr(sp2 + 1);
+			if (version_.substr(0, 7) != "HTTP/1.") {
+				return error_new(ERROR_SYSTEM_PACKET_INVALID, "unsupported version %s", std::string(version_).c_str());
+			}
+
+			size_t pos = eol + 2;
+			bool close = false, keep_alive = false;
+			while (true) {
+				eol = msg.find("\r\n", pos);
+				if (eol == std::string_view::npos) {
+					return error_new(ERROR_SYSTEM_PACKET_INVALID, "no header end");
+				}
+				line = msg.substr(pos, eol - pos);
+				pos = eol + 2;
+				if (line.empty()) {
+					break;
+				}
+
+				size_t colon = line.find(':');
+				if (colon == std::string_view::npos || colon == 0) {
+					return error_new(ERROR_SYSTEM_PACKET_INVALID, "invalid header");
+				}
+				if (nb_headers_ >= HTTP_MAX_HEADERS) {
+					return error_new(ERROR_SYSTEM_PACKET_INVALID, "headers exceed %d", HTTP_MAX_HEADERS);
+				}
+
+				HttpHeader& h = headers_[nb_headers_++];
+				h.name = line.substr(0, colon);
+				h.value = __detail::http_trim(line.substr(colon + 1));
+				if (__detail::http_iequals(h.name, "connection")) {
+					close = __detail::http_iequals(h.value, "close");
+					keep_alive = __detail::http_iequals(h.value, "keep-alive");
+				}
+				else if (__detail::http_iequals(h.name, "transfer-encoding")) {
+					chunked_ = __detail::http_is_chunked(h.value);
+				}
+			}
+
+			// HTTP/1.1 keeps alive unless closed, HTTP/1.0 closes unless kept alive.
+			keep_alive_ = version_ == "HTTP/1.0" ? keep_alive : !close;
+
+			body_ = msg.substr(pos);
+			if (chunked_) {
+				error_t err;
+				size_t n = 0;
+				if ((err = __detail::http_chunks(body_, &n, &chunked_body_)) != error_ok) {
+					return error_trace(err);
+				}
+				if (n == 0) {
+					return error_new(ERROR_SYSTEM_PACKET_INVALID, "incomplete chunked body");
+				}
+				body_ = chunked_body_;
+			}
+			return error_ok;
+		}
+
+		std::string_view method() const { return method_; }
+		// The path with the query, for example /index.html?a=1
+		std::string_view target() const { return target_; }
+		std::string_view path() const { return target_.substr(0, target_.find('?')); }
+		std::string_view query() const {
+			size_t pos = target_.find('?');
+			return pos == std::string_view::npos ? std::string_view() : target_.substr(pos + 1);
+		}
+		std::string_view version() const { return version_; }
+		bool keep_alive() const { return keep_alive_; }
+		bool chunked() const { return chunked_; }
+		std::string_view body() const { return body_; }
+
+		int headers() const { return nb_headers_; }
+		const HttpHeader& header_at(int i) const { return headers_[i]; }
+
+		// The value of the first header of the name, which is case insensitive, empty if none.
+		std::string_view header(std::string_view name) const {
+			for (int i = 0; i < nb_headers_; i++) {
+				if (__detail::http_iequals(headers_[i].name, name)) {
+					return headers_[i].value;
+				}
+			}
+			return std::string_view();
+		}
+
+	private:
+		std::string_view method_;
+		std::string_view target_;
+		std::string_view version_;
+		std::string_view body_;
+		HttpHeader headers_[HTTP_MAX_HEADERS];
+		int nb_headers_ = 0;
+		bool keep_alive_ = false;
+		bool chunked_ = false;
+		std::string chunked_body_;
+	};
+
+	// The response builder, the content-length and the connection headers are added by it.
+	class HttpResponse {
+	public:
+		explicit HttpResponse(int status = 200, std::string_view reason = std::string_view()) {
+			set_status(status, reason);
+		}
+
+		void set_status(int status, std::string_view reason = std::string_view()) {
+			status_ = status;
+			reason_ = reason.empty() ? reason_of(status) : reason;
+		}
+
+		// The name and the value are copied.
+		void add_header(std::string_view name, std::string_view value) {
+			headers_.append(name.data(), name.size());
+			headers_.append(": ", 2);
+			headers_.append(value.data(), value.size());
+			headers_.append("\r\n", 2);
+		}
+
+		// Close the connection after the response when off, see HttpRequest::keep_alive.
+		void set_keep_alive(bool on) { keep_alive_ = on; }
+
+		// The body is not copied, it must be valid until written.
+		void set_body(std::string_view body) { body_ = body; }
+
+		// Write the head and the body, a small body is copied after the head as one message,
+		// which is gathered with the other responses when the connection is corked, so the
+		// responses of the pipelined requests are written by one writev. A large body is not
+		// copied, the head and the body are written by one writev.
+		template<typename ConnPtr>
+		error_t write(const ConnPtr& conn) {
+			error_t err;
+			std::string head;
+			head.reserve(64 + headers_.size() + (body_.size() <= HTTP_COPY_BODY_SIZE ? body_.size() : 0));
+			head.append("HTTP/1.1 ");
+			head.append(std::to_string(status_));
+			head.append(" ");
+			head.append(reason_.data(), reason_.size());
+			head.append("\r\n");
+			head.append(headers_);
+			head.append("Content-Length: ");
+			head.append(std::to_string(body_.size()));
+			head.append(keep_alive_ ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+
+			if (body_.size() <= HTTP_COPY_BODY_SIZE) {
+				head.append(body_.data(), body_.size());
+				if ((err = conn->write((void*)head.data(), head.size())) != error_ok) {
+					return error_trace(err);
+				}
+				return err;
+			}
+
+			IovecList iovs;
+			iovs.append(head.data(), head.size());
+			iovs.append(body_.data(), body_.size());
+			if ((err = conn->writev(iovs)) != error_ok) {
+				return error_trace(err);
+			}
+			return err;
+		}
+
+	private:
+		static std::string_view reason_of(int status) {
+			switch (status) {
+			case 100: return "Continue";
+			case 200: return "OK";
+			case 201: return "Created";
+			case 204: return "No Content";
+			case 206: return "Partial Content";
+			case 301: return "Moved Permanently";
+			case 302: return "Found";
+			case 304: return "Not Modified";
+			case 400: return "Bad Request";
+			case 401: return "Unauthorized";
+			case 403: return "Forbidden";
+			case 404: return "Not Found";
+			case 405: return "Method Not Allowed";
+			case 408: return "Request Timeout";
+			case 413: return "Payload Too Large";
+			case 500: return "Internal Server Error";
+			case 501: return "Not Implemented";
+			case 502: return "Bad Gateway";
+			case 503: return "Service Unavailable";
+			default: return "Unknown";
+			}
+		}
+
+	private:
+		int status_ = 200;
+		std::string_view reason_;
+		std::string headers_;
+		std::string_view body_;
+		bool keep_alive_ = true;
+	};
+}
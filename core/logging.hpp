@@ -1,13 +1,25 @@
 #pragma once
+#include <algorithm>
 #include <chrono>
+#include <ctime>
 #include <iomanip>
 #include <iostream>
 #include <cstring>
+#include <ostream>
 #include <sstream>
+#include <streambuf>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #define ENABLE_ST_COROUTINE
 
 #ifdef ENABLE_ST_COROUTINE
+#include <st.h>
 #include "coroutine.hpp"
 namespace st {
 	namespace this_coroutine {
@@ -19,50 +31,449 @@ namespace st {
 #define __FILENAME__ (strrchr(__FILE__, '/') ? (strrchr(__FILE__, '/') + 1):__FILE__)
 enum { TRACE, INFO, WARNNING, ERROR };
 
+// The bytes of a log line formatted on the stack, a longer line grows to the heap.
+#define LOG_LINE_SIZE 512
+
 namespace st {
-	static std::string GetCurrentTimeStamp()
+	// The clock of the log timestamp.
+	enum class TimeStampClock {
+		// The clock_gettime for each line.
+		system,
+#ifdef ENABLE_ST_COROUTINE
+		// The st_utime, which is the gettimeofday or the one by st_set_utime_function.
+		st_utime,
+		// The clock sampled by the ST scheduler on each loop, no syscall but only valid
+		// in the threads running the ST scheduler.
+		st_last_clock,
+#endif
+	};
+
+	inline std::atomic<TimeStampClock>& TimeStampClockRef() {
+		static std::atomic<TimeStampClock> clock{ TimeStampClock::system };
+		return clock;
+	}
+
+	inline void SetTimeStampClock(TimeStampClock clock) {
+		TimeStampClockRef() = clock;
+	}
+
+	// Format the timestamp like "20220101 12:00:00.12345678" into buf and return the length.
+	// The date and time part is cached per second per thread, only the sub-second part
+	// is formatted for each call.
+	inline size_t FormatTimeStamp(char* buf, size_t size)
+	{
+		time_t sec;
+		long ns;
+		TimeStampClock clock = TimeStampClockRef().load(std::memory_order_relaxed);
+		switch (clock) {
+#ifdef ENABLE_ST_COROUTINE
+		case TimeStampClock::st_utime:
+		case TimeStampClock::st_last_clock: {
+			st_utime_t us = clock == TimeStampClock::st_utime ? st_utime() : st_utime_last_clock();
+			sec = (time_t)(us / 1000000);
+			ns = (long)(us % 1000000) * 1000;
+			break;
+		}
+#endif
+		default: {
+			timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			sec = ts.tv_sec;
+			ns = ts.tv_nsec;
+			break;
+		}
+		}
+
+		struct Cache {
+			time_t sec = -1;
+			char prefix[32];
+			size_t len = 0;
+		};
+		static thread_local Cache cache;
+		if (sec != cache.sec) {
+			std::tm now_tm;
+			localtime_r(&sec, &now_tm);
+			//Date:\n%Y-%m-%d\nTime:\n%I:%M:%S\n"
+			cache.len = strftime(cache.prefix, sizeof(cache.prefix), "%Y%m%d %H:%M:%S", &now_tm);
+			cache.sec = sec;
+		}
+
+		// The nanoseconds, zero padded to at least 8 digits.
+		char digits[16];
+		int nd = 0;
+		do {
+			digits[nd++] = '0' + ns % 10;
+			ns /= 10;
+		} while (ns > 0);
+		while (nd < 8) {
+			digits[nd++] = '0';
+		}
+
+		if (size < cache.len + nd + 2) {
+			return 0;
+		}
+
+		memcpy(buf, cache.prefix, cache.len);
+		size_t n = cache.len;
+		buf[n++] = '.';
+		while (nd > 0) {
+			buf[n++] = digits[--nd];
+		}
+		buf[n] = '\0';
+		return n;
+	}
+
+	inline std::string GetCurrentTimeStamp()
 	{
-		std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+		char buffer[64];
+		size_t n = FormatTimeStamp(buffer, sizeof(buffer));
+		return std::string(buffer, n);
+	}
+
+	// What to do when the ring of a thread is full. The block waits for the background
+	// thread by st_usleep in an ST thread, so only the coroutine waits but not the others.
+	enum class LogOverflow { drop, block };
+
+	// The async log sink, every thread appends its lines to its own lock free ring,
+	// and a background thread drains all rings to stdout or a file in batches, so a
+	// slow output never blocks the scheduler.
+	class AsyncLogSink {
+	public:
+		static AsyncLogSink& instance() {
+			static AsyncLogSink sink;
+			return sink;
+		}
+
+		~AsyncLogSink() {
+			stop();
+		}
+
+		AsyncLogSink(const AsyncLogSink&) = delete;
+		AsyncLogSink& operator=(const AsyncLogSink&) = delete;
+
+		// @param path, the file to append to, nullptr for stdout.
+		// @param ring_size, the bytes of ring per thread, rounded up to power of 2.
+		bool start(const char* path = nullptr, LogOverflow policy = LogOverflow::drop, size_t ring_size = 256 * 1024) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (running_) {
+				return true;
+			}
+
+			fd_ = STDOUT_FILENO;
+			if (path) {
+				fd_ = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+				if (fd_ == -1) {
+					return false;
+				}
+			}
+
+			size_t size = 4096;
+			while (size < ring_size) {
+				size *= 2;
+			}
+			ring_size_.store(size, std::memory_order_relaxed);
+			policy_.store(policy, std::memory_order_relaxed);
+			exit_ = false;
+			thread_ = std::thread(&AsyncLogSink::run, this);
+			running_ = true;
+			return true;
+		}
+
+		// Drain all lines and stop the background thread.
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (!running_) {
+					return;
+				}
+				running_ = false;
+				exit_ = true;
+			}
+			cond_.notify_one();
+			thread_.join();
+
+			if (fd_ != STDOUT_FILENO) {
+				::close(fd_);
+			}
+			fd_ = -1;
+		}
+
+		bool running() const { return running_.load(std::memory_order_relaxed); }
+
+		// The lines dropped because the ring was full.
+		uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+		// Append a line of the current thread, return false if dropped.
+		bool append(const char* data, size_t len) {
+			std::shared_ptr<Ring>& ring = local_ring();
+			if (!ring) {
+				ring = std::make_shared<Ring>(ring_size_.load(std::memory_order_relaxed));
+				std::lock_guard<std::mutex> lock(mutex_);
+				rings_.push_back(ring);
+			}
+
+			while (!ring->push(data, len)) {
+				if (policy_.load(std::memory_order_relaxed) == LogOverflow::drop || !running()) {
+					dropped_.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+				cond_.notify_one();
+				wait_drained();
+			}
+			return true;
+		}
+
+	private:
+		AsyncLogSink() = default;
+
+		// Wait a while for the background thread to drain the ring, never freeze the
+		// scheduler of an ST thread.
+		static void wait_drained() {
+#ifdef ENABLE_ST_COROUTINE
+			if (st_thread_self()) {
+				st_usleep(50);
+				return;
+			}
+#endif
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+
+		// The single producer single consumer ring of records, a record is the 4 bytes
+		// length and the data, aligned to 8 bytes. A record never wraps, the producer
+		// writes a wrap marker and starts from the beginning instead.
+		class Ring {
+		public:
+			explicit Ring(size_t size) :buf_(new char[size]), size_(size) {}
+
+			bool push(const char* data, size_t len) {
+				// The longest record is half of the ring, the line is truncated.
+				len = std::min(len, size_ / 2 - sizeof(uint32_t));
+				size_t need = align(sizeof(uint32_t) + len);
+				size_t tail = tail_.load(std::memory_order_relaxed);
+				size_t free = size_ - (tail - head_.load(std::memory_order_acquire));
+				size_t pos = tail & (size_ - 1);
+				size_t room = size_ - pos;
+
+				if (room < need) {
+					if (free < room + need) {
+						return false;
+					}
+					uint32_t marker = WRAP;
+					memcpy(buf_.get() + pos, &marker, sizeof(marker));
+					tail += room;
+					pos = 0;
+				}
+				else if (free < need) {
+					return false;
+				}
+
+				uint32_t n = (uint32_t)len;
+				memcpy(buf_.get() + pos, &n, sizeof(n));
+				memcpy(buf_.get() + pos + sizeof(n), data, len);
+				tail_.store(tail + need, std::memory_order_release);
+				return true;
+			}
+
+			// Append all records to out, return the number of records.
+			int drain(std::string& out) {
+				int n = 0;
+				size_t head = head_.load(std::memory_order_relaxed);
+				size_t tail = tail_.load(std::memory_order_acquire);
+				while (head < tail) {
+					size_t pos = head & (size_ - 1);
+					uint32_t len;
+					memcpy(&len, buf_.get() + pos, sizeof(len));
+					if (len == WRAP) {
+						head += size_ - pos;
+						continue;
+					}
+					out.append(buf_.get() + pos + sizeof(len), len);
+					head += align(sizeof(len) + len);
+					n++;
+				}
+				head_.store(head, std::memory_order_release);
+				return n;
+			}
+
+			// Set when the thread quits, the ring is freed once drained.
+			std::atomic<bool> closed{ false };
+
+		private:
+			static const uint32_t WRAP = 0xFFFFFFFF;
+			static size_t align(size_t n) { return (n + 7) & ~(size_t)7; }
+
+			std::unique_ptr<char[]> buf_;
+			size_t size_;
+			std::atomic<size_t> head_{ 0 };
+			std::atomic<size_t> tail_{ 0 };
+		};
+
+		// Close the ring when the thread quits.
+		struct RingHolder {
+			std::shared_ptr<Ring> ring;
+			~RingHolder() {
+				if (ring) {
+					ring->closed = true;
+				}
+			}
+		};
+
+		static std::shared_ptr<Ring>& local_ring() {
+			static thread_local RingHolder holder;
+			return holder.ring;
+		}
+
+		void run() {
+			std::string batch;
+			uint64_t reported = 0;
+			while (true) {
+				bool quit = exit_;
+				std::vector<std::shared_ptr<Ring>> rings;
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					rings = rings_;
+				}
+
+				for (auto& it : rings) {
+					bool closed = it->closed;
+					it->drain(batch);
+					if (closed) {
+						std::lock_guard<std::mutex> lock(mutex_);
+						rings_.erase(std::find(rings_.begin(), rings_.end(), it));
+					}
+				}
+
+				uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+				if (dropped != reported) {
+					batch += "W" + std::to_string(dropped - reported) + " log lines dropped\n";
+					reported = dropped;
+				}
 
-		std::time_t now_time_t = std::chrono::system_clock::to_time_t(now);
-		std::tm* now_tm = std::localtime(&now_time_t);
+				if (!batch.empty()) {
+					flush(batch);
+					batch.clear();
+					continue;
+				}
 
-		char buffer[128];
-		//Date:\n%Y-%m-%d\nTime:\n%I:%M:%S\n"
-		strftime(buffer, sizeof(buffer), "%Y%m%d %H:%M:%S", now_tm);
+				if (quit) {
+					break;
+				}
+
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_.wait_for(lock, std::chrono::milliseconds(10));
+			}
+		}
 
-		std::stringstream ss;
-		ss.fill('0');
-		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()) % 1000000000;
-		ss << buffer << "." << std::setw(8) << std::setfill('0') << std::setiosflags(std::ios::right) << ns.count();
-		return ss.str();
+		void flush(const std::string& batch) {
+			size_t nwrite = 0;
+			while (nwrite < batch.size()) {
+				ssize_t r = ::write(fd_, batch.data() + nwrite, batch.size() - nwrite);
+				if (r < 0 && errno == EINTR) {
+					continue;
+				}
+				if (r <= 0) {
+					return;
+				}
+				nwrite += r;
+			}
+		}
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		std::vector<std::shared_ptr<Ring>> rings_;
+		std::thread thread_;
+		std::atomic<bool> running_{ false };
+		std::atomic<bool> exit_{ false };
+		std::atomic<uint64_t> dropped_{ 0 };
+		// Read by the logging threads without the lock.
+		std::atomic<LogOverflow> policy_{ LogOverflow::drop };
+		std::atomic<size_t> ring_size_{ 256 * 1024 };
+		int fd_ = -1;
+	};
+
+	namespace __detail {
+		// The buffer of a log line, in the object until the line exceeds LOG_LINE_SIZE, then
+		// the line is moved to a string. It's on the stack of the caller, so the coroutines
+		// which switch while logging never share it.
+		class log_line_buf :public std::streambuf {
+		public:
+			log_line_buf() {
+				setp(buf_, buf_ + sizeof(buf_));
+			}
+
+			const char* data() const { return spilled_ ? long_.data() : buf_; }
+			size_t size() const { return spilled_ ? long_.size() : (size_t)(pptr() - buf_); }
+
+		protected:
+			virtual int_type overflow(int_type c) override {
+				spill();
+				if (!traits_type::eq_int_type(c, traits_type::eof())) {
+					long_.push_back(traits_type::to_char_type(c));
+				}
+				return traits_type::not_eof(c);
+			}
+
+			virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+				if (!spilled_ && n <= epptr() - pptr()) {
+					memcpy(pptr(), s, (size_t)n);
+					pbump((int)n);
+					return n;
+				}
+				spill();
+				long_.append(s, (size_t)n);
+				return n;
+			}
+
+		private:
+			void spill() {
+				if (spilled_) {
+					return;
+				}
+				long_.assign(buf_, pptr() - buf_);
+				setp(nullptr, nullptr);
+				spilled_ = true;
+			}
+
+		private:
+			char buf_[LOG_LINE_SIZE];
+			std::string long_;
+			bool spilled_ = false;
+		};
 	}
 
+	// A log line, which is formatted to a buffer on the stack without allocation unless
+	// it exceeds LOG_LINE_SIZE.
 	class LogStream {
+	private:
+		// Declared before ss, which writes to it.
+		__detail::log_line_buf buf_;
 	public:
-		LogStream(std::ostream& stream, int level, const char* file, int line) :os(stream), _level(level) {
+		LogStream(std::ostream& stream, int level, const char* file, int line) :os(stream), ss(&buf_), _level(level) {
 			if (level < __log_level_limit)
 				return;
-			std::string lestr;
+			char lestr = ' ';
 			switch (level) {
 			case TRACE:
-				lestr = "T";
+				lestr = 'T';
 				break;
 			case INFO:
-				lestr = "I";
+				lestr = 'I';
 				break;
 			case WARNNING:
-				lestr = "W";
+				lestr = 'W';
 				break;
 			case ERROR:
-				lestr = "E";
+				lestr = 'E';
 				break;
 			}
 
+			char ts[64];
+			FormatTimeStamp(ts, sizeof(ts));
 #ifdef ENABLE_ST_COROUTINE
-			ss << lestr << GetCurrentTimeStamp() << " " << std::this_thread::get_id() << " " << st::this_coroutine::get_id() << " " << file << ":" << line << "] ";
+			ss << lestr << ts << " " << std::this_thread::get_id() << " " << st::this_coroutine::get_id() << " " << file << ":" << line << "] ";
 #else
-			ss << lestr << GetCurrentTimeStamp() << " " << std::this_thread::get_id() << " " << file << ":" << line << "] ";
+			ss << lestr << ts << " " << std::this_thread::get_id() << " " << file << ":" << line << "] ";
 #endif
 		}
 
@@ -70,13 +481,17 @@ namespace st {
 			if (_level < __log_level_limit)
 				return;
 			ss << '\n';
-			os << ss.str();
+			if (AsyncLogSink::instance().running()) {
+				AsyncLogSink::instance().append(buf_.data(), buf_.size());
+				return;
+			}
+			os.write(buf_.data(), buf_.size());
 		}
 
 		static void setLogLevel(int level) { LogStream::__log_level_limit = level; }
 
 		std::ostream& os;
-		std::stringstream ss;
+		std::ostream ss;
 	private:
 		static int __log_level_limit;
 		int _level;
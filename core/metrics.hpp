@@ -0,0 +1,309 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "consts.hpp"
+#include "histogram.hpp"
+
+// The max counters and gauges of all names and labels.
+#define METRICS_MAX_SERIES 1024
+// The max summaries of all names and labels.
+#define METRICS_MAX_SUMMARIES 64
+// The error codes counted by their own series, from ERROR_SOCKET_CREATE.
+#define METRICS_ERROR_CODES 256
+
+namespace st {
+	enum class metric_type {
+		counter,
+		gauge,
+		summary,
+	};
+
+	// The registry of the counters, the gauges and the summaries. Each thread updates its
+	// own shard without lock, and the shards of all threads are merged when scraped, in the
+	// Prometheus text format. The gauges of the threads are summed too, so a gauge is moved
+	// by add and sub, for example the active connections.
+	// @remark Updating a counter or a gauge is a relaxed load and store of the thread.
+	class MetricsRegistry {
+	public:
+		static MetricsRegistry& instance() {
+			static MetricsRegistry* registry = new MetricsRegistry();
+			return *registry;
+		}
+
+		// Register a series, the labels are formatted like `code="1011"`. The same name and
+		// labels return the same id, -1 when the series are full. The counters and the gauges
+		// share the ids, and the summaries have their own.
+		int add(metric_type type, const std::string& name, const std::string& help, const std::string& labels = "") {
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::string key = name + "{" + labels + "}";
+			auto it = index_.find(key);
+			if (it != index_.end()) {
+				return it->second;
+			}
+
+			int slot = type == metric_type::summary ? nb_summaries_ : nb_values_;
+			if (slot >= (type == metric_type::summary ? METRICS_MAX_SUMMARIES : METRICS_MAX_SERIES)) {
+				return -1;
+			}
+			if (type == metric_type::summary) {
+				nb_summaries_++;
+			}
+			else {
+				nb_values_++;
+			}
+
+			series_.push_back(series{ type, name, help, labels, slot });
+			index_[key] = slot;
+			return slot;
+		}
+
+		// Add n to the counter or the gauge of the current thread.
+		void add(int id, int64_t n) {
+			if (id < 0) {
+				return;
+			}
+			std::atomic<int64_t>& v = local()->values[id];
+			v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+		// Record a value to the summary of the current thread.
+		void observe(int id, int64_t v) {
+			if (id < 0) {
+				return;
+			}
+			shard* s = local();
+			std::lock_guard<std::mutex> lock(s->mutex);
+			std::unique_ptr<Histogram>& h = s->summaries[id];
+			if (!h) {
+				h.reset(new Histogram());
+			}
+			h->record(v);
+		}
+
+		// Count an error by its code, see error_new.
+		void count_error(int code) {
+			int i = code - ERROR_SOCKET_CREATE;
+			if (i < 0 || i >= METRICS_ERROR_CODES) {
+				add(add(metric_type::counter, "st_errors_total", "The errors created, by code.", "code=\"other\""), 1);
+				return;
+			}
+
+			// The id plus 1, 0 when it's not registered.
+			int id = errors_[i].load(std::memory_order_acquire);
+			if (id == 0) {
+				id = add(metric_type::counter, "st_errors_total", "The errors created, by code.", "code=\"" + std::to_string(code) + "\"") + 1;
+				errors_[i].store(id, std::memory_order_release);
+			}
+			add(id - 1, 1);
+		}
+
+		// The merged value of a counter or a gauge.
+		int64_t value(int id) {
+			if (id < 0) {
+				return 0;
+			}
+			std::lock_guard<std::mutex> lock(mutex_);
+			int64_t v = 0;
+			for (auto& s : shards_) {
+				v += s->values[id].load(std::memory_order_relaxed);
+			}
+			return v;
+		}
+
+		// The series of all threads in the Prometheus text format.
+		std::string scrape() {
+			std::vector<series> all;
+			std::vector<std::shared_ptr<shard>> shards;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				all = series_;
+				shards = shards_;
+			}
+
+			// The series of a name are written together, in the order of registration.
+			std::vector<std::string> names;
+			std::unordered_map<std::string, std::vector<int>> groups;
+			for (int i = 0; i < (int)all.size(); i++) {
+				std::vector<int>& g = groups[all[i].name];
+				if (g.empty()) {
+					names.push_back(all[i].name);
+				}
+				g.push_back(i);
+			}
+
+			std::string out;
+			char buf[256];
+			for (auto& name : names) {
+				std::vector<int>& g = groups[name];
+				const series& first = all[g.front()];
+				out += "# HELP " + name + " " + first.help + "\n";
+				out += "# TYPE " + name + " " + type_name(first.type) + "\n";
+
+				for (int i : g) {
+					const series& m = all[i];
+					if (m.type != metric_type::summary) {
+						int64_t v = 0;
+						for (auto& s : shards) {
+							v += s->values[m.slot].load(std::memory_order_relaxed);
+						}
+						snprintf(buf, sizeof(buf), " %lld\n", (long long)v);
+						out += name + braces(m.labels) + buf;
+						continue;
+					}
+
+					Histogram h;
+					for (auto& s : shards) {
+						std::lock_guard<std::mutex> lock(s->mutex);
+						if (s->summaries[m.slot]) {
+							h.merge(*s->summaries[m.slot]);
+						}
+					}
+					std::string labels = m.labels.empty() ? "" : m.labels + ",";
+					const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+					for (double q : quantiles) {
+						snprintf(buf, sizeof(buf), "{%squantile=\"%g\"} %lld\n", labels.c_str(), q, (long long)h.percentile(q * 100));
+						out += name + buf;
+					}
+					snprintf(buf, sizeof(buf), " %.0f\n", h.mean() * h.count());
+					out += name + "_sum" + braces(m.labels) + buf;
+					snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long)h.count());
+					out += name + "_count" + braces(m.labels) + buf;
+				}
+			}
+			return out;
+		}
+
+	private:
+		MetricsRegistry() {
+			for (auto& it : errors_) {
+				it.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		struct series {
+			metric_type type;
+			std::string name;
+			std::string help;
+			std::string labels;
+			// The id, the index in the values or the summaries of the shards.
+			int slot;
+		};
+
+		struct shard {
+			std::atomic<int64_t> values[METRICS_MAX_SERIES];
+			// Guards the summaries, which are read when scraped.
+			std::mutex mutex;
+			std::unique_ptr<Histogram> summaries[METRICS_MAX_SUMMARIES];
+
+			shard() {
+				for (auto& it : values) {
+					it.store(0, std::memory_order_relaxed);
+				}
+			}
+		};
+
+		// The shard of the current thread, which is kept after the thread quits, so the
+		// counters never go back.
+		shard* local() {
+			static thread_local shard* s = nullptr;
+			if (!s) {
+				std::shared_ptr<shard> p = std::make_shared<shard>();
+				std::lock_guard<std::mutex> lock(mutex_);
+				shards_.push_back(p);
+				s = p.get();
+			}
+			return s;
+		}
+
+		static const char* type_name(metric_type type) {
+			switch (type) {
+			case metric_type::counter: return "counter";
+			case metric_type::gauge: return "gauge";
+			default: return "summary";
+			}
+		}
+
+		static std::string braces(const std::string& labels) {
+			return labels.empty() ? "" : "{" + labels + "}";
+		}
+
+	private:
+		std::mutex mutex_;
+		std::vector<series> series_;
+		std::unordered_map<std::string, int> index_;
+		std::vector<std::shared_ptr<shard>> shards_;
+		int nb_values_ = 0;
+		int nb_summaries_ = 0;
+		std::atomic<int> errors_[METRICS_ERROR_CODES];
+	};
+
+	// The handle of a counter, which only goes up.
+	class Counter {
+	public:
+		Counter(const std::string& name, const std::string& help, const std::string& labels = "") {
+			id_ = MetricsRegistry::instance().add(metric_type::counter, name, help, labels);
+		}
+
+		void inc(int64_t n = 1) const { MetricsRegistry::instance().add(id_, n); }
+		int64_t value() const { return MetricsRegistry::instance().value(id_); }
+
+	private:
+		int id_;
+	};
+
+	// The handle of a gauge, the sum of the gauges of all threads.
+	class Gauge {
+	public:
+		Gauge(const std::string& name, const std::string& help, const std::string& labels = "") {
+			id_ = MetricsRegistry::instance().add(metric_type::gauge, name, help, labels);
+		}
+
+		void add(int64_t n) const { MetricsRegistry::instance().add(id_, n); }
+		void sub(int64_t n) const { MetricsRegistry::instance().add(id_, -n); }
+		int64_t value() const { return MetricsRegistry::instance().value(id_); }
+
+	private:
+		int id_;
+	};
+
+	// The handle of a summary, the quantiles, the sum and the count of the values, for
+	// example the latency in microseconds.
+	class Summary {
+	public:
+		Summary(const std::string& name, const std::string& help, const std::string& labels = "") {
+			id_ = MetricsRegistry::instance().add(metric_type::summary, name, help, labels);
+		}
+
+		void observe(int64_t v) const { MetricsRegistry::instance().observe(id_, v); }
+
+	private:
+		int id_;
+	};
+
+	namespace __detail {
+		// The metrics of the library.
+		struct builtin_metrics {
+			Counter socket_read_bytes{ "st_socket_read_bytes_total", "The bytes read from the sockets." };
+			Counter socket_write_bytes{ "st_socket_write_bytes_total", "The bytes written to the sockets." };
+			Counter tcp_accepted{ "st_tcp_accepted_total", "The connections accepted by the servers." };
+			Counter tcp_rejected{ "st_tcp_rejected_total", "The connections dropped for the max connections." };
+			Counter tcp_closed{ "st_tcp_closed_total", "The connections closed by the servers." };
+			Gauge tcp_connections{ "st_tcp_connections", "The active connections of the servers." };
+			Counter tcp_messages_read{ "st_tcp_messages_read_total", "The messages decoded by the connections." };
+			Counter tcp_messages_written{ "st_tcp_messages_written_total", "The messages encoded by the connections." };
+			Counter coroutines_created{ "st_coroutines_created_total", "The coroutines started." };
+			Gauge coroutines{ "st_coroutines", "The live coroutines." };
+
+			static builtin_metrics& get() {
+				static builtin_metrics* m = new builtin_metrics();
+				return *m;
+			}
+		};
+	}
+}
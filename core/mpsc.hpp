@@ -0,0 +1,219 @@
+#pragma once
+#include <st.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace st {
+	enum class queue_status { ok, timeout, closed, interrupted };
+
+	// The queue to pass items from any OS threads to a coroutine. The producers append
+	// to a vector under a mutex, and write the eventfd only when the consumer sleeps on
+	// it, so a busy consumer takes the items in batches without any syscall. The consumer
+	// waits for the eventfd by st_netfd_poll, so the other coroutines of its ST thread go on.
+	// @remark Only one coroutine pops, which must be in one ST thread.
+	template<typename T>
+	class mpsc_queue {
+	public:
+		mpsc_queue() {
+			efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (efd_ == -1) {
+				throw std::runtime_error("eventfd failed");
+			}
+		}
+
+		~mpsc_queue() {
+			if (nfd_) {
+				st_netfd_close(nfd_);
+			}
+			else {
+				::close(efd_);
+			}
+		}
+
+		mpsc_queue(const mpsc_queue&) = delete;
+		mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+		// Called by any thread, return false if the queue is closed.
+		bool push(T v) {
+			bool wake;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (closed_) {
+					return false;
+				}
+				items_.push_back(std::move(v));
+				wake = sleeping_;
+				sleeping_ = false;
+			}
+			if (wake) {
+				notify();
+			}
+			return true;
+		}
+
+		// Push the items by one lock and at most one wakeup.
+		template<typename InputIt>
+		bool push_bulk(InputIt first, InputIt last) {
+			bool wake;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (closed_) {
+					return false;
+				}
+				for (; first != last; ++first) {
+					items_.push_back(std::move(*first));
+				}
+				wake = sleeping_;
+				sleeping_ = false;
+			}
+			if (wake) {
+				notify();
+			}
+			return true;
+		}
+
+		// Reject the new items and wake the consumer, which still gets the queued ones.
+		void close() {
+			bool wake;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				closed_ = true;
+				wake = sleeping_;
+				sleeping_ = false;
+			}
+			if (wake) {
+				notify();
+			}
+		}
+
+		bool closed() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return closed_;
+		}
+
+		bool try_pop(T& v) {
+			if (pos_ == batch_.size() && !take()) {
+				return false;
+			}
+			v = std::move(batch_[pos_++]);
+			return true;
+		}
+
+		// Wait for an item, return closed when the queue is closed and empty.
+		queue_status pop(T& v) {
+			return pop_impl(v, ST_UTIME_NO_TIMEOUT);
+		}
+
+		template<typename _Rep, typename _Period>
+		queue_status pop_for(T& v, const std::chrono::duration<_Rep, _Period>& rtime) {
+			return pop_impl(v, to_utime(rtime));
+		}
+
+		// Wait for the items, move all queued items to the back of out.
+		queue_status pop_all(std::vector<T>& out) {
+			return pop_all_impl(out, ST_UTIME_NO_TIMEOUT);
+		}
+
+		template<typename _Rep, typename _Period>
+		queue_status pop_all_for(std::vector<T>& out, const std::chrono::duration<_Rep, _Period>& rtime) {
+			return pop_all_impl(out, to_utime(rtime));
+		}
+
+	private:
+		template<typename _Rep, typename _Period>
+		static st_utime_t to_utime(const std::chrono::duration<_Rep, _Period>& rtime) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtime).count();
+			return us > 0 ? (st_utime_t)us : 0;
+		}
+
+		queue_status pop_impl(T& v, st_utime_t timeout) {
+			while (!try_pop(v)) {
+				queue_status s = wait(timeout);
+				if (s != queue_status::ok) {
+					return try_pop(v) ? queue_status::ok : s;
+				}
+			}
+			return queue_status::ok;
+		}
+
+		queue_status pop_all_impl(std::vector<T>& out, st_utime_t timeout) {
+			while (pos_ == batch_.size() && !take()) {
+				queue_status s = wait(timeout);
+				if (s != queue_status::ok) {
+					if (!take()) {
+						return s;
+					}
+					break;
+				}
+			}
+
+			for (; pos_ < batch_.size(); pos_++) {
+				out.push_back(std::move(batch_[pos_]));
+			}
+			return queue_status::ok;
+		}
+
+		// Swap the queued items to the batch of the consumer.
+		bool take() {
+			batch_.clear();
+			pos_ = 0;
+			std::lock_guard<std::mutex> lock(mutex_);
+			batch_.swap(items_);
+			return !batch_.empty();
+		}
+
+		// Sleep on the eventfd until the producers push or close, return ok to check again.
+		queue_status wait(st_utime_t timeout) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (!items_.empty()) {
+					return queue_status::ok;
+				}
+				if (closed_) {
+					return queue_status::closed;
+				}
+				sleeping_ = true;
+			}
+
+			if (!nfd_ && (nfd_ = st_netfd_open(efd_)) == NULL) {
+				throw std::runtime_error("st_netfd_open failed");
+			}
+
+			queue_status s = queue_status::ok;
+			if (st_netfd_poll(nfd_, POLLIN, timeout) == -1) {
+				s = errno == ETIME ? queue_status::timeout : queue_status::interrupted;
+			}
+
+			uint64_t n;
+			ssize_t r = ::read(efd_, &n, sizeof(n));
+			(void)r;
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			sleeping_ = false;
+			return s;
+		}
+
+		void notify() {
+			uint64_t n = 1;
+			ssize_t r = ::write(efd_, &n, sizeof(n));
+			(void)r;
+		}
+
+	private:
+		std::mutex mutex_;
+		std::vector<T> items_;
+		bool sleeping_ = false;
+		bool closed_ = false;
+		int efd_;
+		st_netfd_t nfd_ = NULL;
+		// The items taken by the consumer, popped from pos_.
+		std::vector<T> batch_;
+		size_t pos_ = 0;
+	};
+}
@@ -6,10 +6,28 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <algorithm>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <deque>
+#include <string_view>
+#include <climits>
 #include "coroutine.hpp"
 #include "error.hpp"
 #include "autofree.hpp"
+#include "buffer.hpp"
+#include "slotmap.hpp"
+#include "timer.hpp"
+#include "resolver.hpp"
+#include "trace.hpp"
 
 namespace st {
 	typedef st_netfd_t netfd_t;
@@ -17,6 +35,26 @@ namespace st {
 
 #define UTIME_NO_TIMEOUT ((st::utime_t) -1LL)
 #define SERVER_LISTEN_BACKLOG 512
+// The interval for the TcpServerGroup workers to check the stop flag.
+#define SERVER_GROUP_CHECK_INTERVAL (100 * UTIME_MILLISECONDS)
+// The default tick of the timing wheel for the idle connections.
+#define SERVER_IDLE_TICK (1 * UTIME_SECONDS)
+// The min bytes to read from the socket into the connection buffer each time.
+#define CONNECTION_READ_SIZE 4096
+// The max bytes of a partial message kept in the connection buffer.
+#define CONNECTION_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+// The corked output is flushed when the gathered bytes or messages reach these.
+#define CONNECTION_CORK_MAX_BYTES (64 * 1024)
+#define CONNECTION_CORK_MAX_COUNT 128
+// The max bytes sent by a sendfile call, which is the limit of linux.
+#define SOCKET_SENDFILE_MAX 0x7ffff000
+// The bytes of the buffer to send a file when sendfile is not supported.
+#define SOCKET_SENDFILE_BUFFER_SIZE (64 * 1024)
+// The default max payload of a frame of the LengthFieldCodec.
+#define LENGTH_FIELD_MAX_FRAME_SIZE (4 * 1024 * 1024)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 	// The time unit in ms, for example 100 * SRS_UTIME_MILLISECONDS means 100ms.
 #define UTIME_MILLISECONDS 1000
 
@@ -98,21 +136,16 @@ namespace st {
 			*pstfd = NULL;
 			netfd_t stfd = NULL;
 
-			char sport[8];
-			snprintf(sport, sizeof(sport), "%d", port);
-
-			addrinfo hints;
-			memset(&hints, 0, sizeof(hints));
-			hints.ai_family = AF_UNSPEC;
-			hints.ai_socktype = SOCK_STREAM;
-
-			addrinfo* r = NULL;
-			SrsAutoFreeH(addrinfo, r, freeaddrinfo);
-			if (getaddrinfo(server.c_str(), sport, (const addrinfo*)&hints, &r)) {
-				return error_new(ERROR_SYSTEM_IP_INVALID, "get address info");
+			// Resolve in the helper threads, the other coroutines go on.
+			error_t err;
+			std::vector<ResolvedAddress> addrs;
+			if ((err = Resolver::instance().resolve(server, addrs, timeout)) != error_ok) {
+				return error_trace(err);
 			}
+			ResolvedAddress& addr = addrs.front();
+			addr.set_port(port);
 
-			int sock = ::socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+			int sock = ::socket(addr.family(), SOCK_STREAM, 0);
 			if (sock == -1) {
 				return error_new(ERROR_SOCKET_CREATE, "create socket");
 			}
@@ -124,7 +157,7 @@ namespace st {
 				return error_new(ERROR_ST_OPEN_SOCKET, "open socket");
 			}
 
-			if (st_connect((st_netfd_t)stfd, r->ai_addr, r->ai_addrlen, timeout) == -1) {
+			if (st_connect((st_netfd_t)stfd, (const sockaddr*)&addr.addr, addr.addrlen, timeout) == -1) {
 				close_stfd(stfd);
 				return error_new(ERROR_ST_CONNECT, "connect to %s:%d", server.c_str(), port);
 			}
@@ -270,8 +303,13 @@ namespace st {
 				return st_accept(listenfd_, addr, addrlen, UTIME_NO_TIMEOUT);
 			}
 
+			// Close the listener, no coroutine may be accepting on it.
+			void close() {
+				close_stfd(listenfd_);
+			}
+
 		private:
-			st::netfd_t  listenfd_;
+			st::netfd_t  listenfd_ = NULL;
 			std::string host_;
 			int port_;
 		};
@@ -311,6 +349,7 @@ namespace st {
 		virtual utime_t get_send_timeout() { return stm; }
 		virtual int64_t get_recv_bytes() { return rbytes; }
 		virtual int64_t get_send_bytes() { return sbytes; }
+		virtual netfd_t get_netfd() { return stfd; }
 	public:
 		// @param nread, the actual read bytes, ignore if NULL.
 		virtual error_t read(void* buf, size_t size, ssize_t* nread) {
@@ -344,6 +383,7 @@ namespace st {
 			}
 
 			rbytes += nb_read;
+			__detail::builtin_metrics::get().socket_read_bytes.inc(nb_read);
 
 			return err;
 		}
@@ -379,6 +419,7 @@ namespace st {
 			}
 
 			rbytes += nb_read;
+			__detail::builtin_metrics::get().socket_read_bytes.inc(nb_read);
 
 			return err;
 		}
@@ -410,6 +451,7 @@ namespace st {
 			}
 
 			sbytes += nb_write;
+			__detail::builtin_metrics::get().socket_write_bytes.inc(nb_write);
 
 			return err;
 		}
@@ -440,13 +482,83 @@ namespace st {
 			}
 
 			sbytes += nb_write;
+			__detail::builtin_metrics::get().socket_write_bytes.inc(nb_write);
 
 			return err;
 		}
+
+		// Send len bytes of the file from offset by sendfile, the bytes never pass through
+		// the user space, and wait in the ST scheduler when the socket would block.
+		// @param nwrite, the actual sent bytes, ignore if NULL.
+		// @remark The send timeout is for each wait, like write.
+		virtual error_t sendfile(int fd, off_t offset, size_t len, ssize_t* nwrite) {
+			error_t err;
+			size_t left = len;
+			ssize_t total = 0;
+#ifndef __linux__
+			std::vector<char> buf(std::min(len, (size_t)SOCKET_SENDFILE_BUFFER_SIZE));
+#endif
+			while (left > 0) {
+#ifdef __linux__
+				ssize_t n = ::sendfile(st_netfd_fileno((st_netfd_t)stfd), fd, &offset, std::min(left, (size_t)SOCKET_SENDFILE_MAX));
+#else
+				ssize_t n = ::pread(fd, buf.data(), std::min(left, buf.size()), offset);
+				if (n > 0) {
+					ssize_t nb_write = 0;
+					if ((err = write(buf.data(), n, &nb_write)) != error_ok) {
+						break;
+					}
+					offset += n;
+					left -= n;
+					total += n;
+					continue;
+				}
+#endif
+				if (n > 0) {
+					left -= n;
+					total += n;
+					sbytes += n;
+					__detail::builtin_metrics::get().socket_write_bytes.inc(n);
+					continue;
+				}
+
+				// The file is shorter than the len.
+				if (n == 0) {
+					err = error_new(ERROR_SYSTEM_FILE_EOF, "sendfile eof, sent %d of %d", (int)total, (int)len);
+					break;
+				}
+
+				if (errno == EINTR) {
+					continue;
+				}
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					if (st_netfd_poll((st_netfd_t)stfd, POLLOUT, stm) == -1) {
+						if (errno == ETIME) {
+							err = error_new(ERROR_SOCKET_TIMEOUT, "sendfile timeout %d ms", u2msi(stm));
+						}
+						else {
+							err = error_new(ERROR_SOCKET_WAIT, "sendfile wait");
+						}
+						break;
+					}
+					continue;
+				}
+
+				err = error_new(ERROR_SOCKET_WRITE, "sendfile");
+				break;
+			}
+
+			if (nwrite) {
+				*nwrite = total;
+			}
+			return err;
+		}
 	};
 
 	using SocketPtr = std::shared_ptr<Socket>;
 	using CodecCallback = std::function<void(std::vector<unsigned char>&&)>;
+	using MessageHandler = std::function<void(std::string_view)>;
 	template<typename Server>
 	class TcpConnection;
 	class TcpServer;
@@ -458,52 +570,444 @@ namespace st {
 		virtual ~IProtoCodec() {}
 		virtual error_t encode(unsigned char* data, size_t len, CodecCallback cbk) = 0;
 		virtual error_t decode(unsigned char* data, size_t len, st::CodecCallback cbk) = 0;
+		// Decode the complete messages at the head of data, which may end with a partial message.
+		// @param nconsumed, the bytes used by the decoded messages, the rest are kept in the
+		//		connection buffer and passed again together with the next bytes read.
+		// @remark The default treats all the data as one message, for the codecs which
+		//		only implement the decode above.
+		virtual error_t decode_partial(unsigned char* data, size_t len, size_t* nconsumed, st::CodecCallback cbk) {
+			*nconsumed = len;
+			return decode(data, len, cbk);
+		}
+	};
+
+	// The zero copy codec, decodes into views of the connection buffer and encodes
+	// into the iovecs which are written by Socket::writev directly.
+	class IStreamCodec {
+	public:
+		virtual ~IStreamCodec() {}
+		// Decode the complete messages at the head of data, every message is passed to
+		// the handler as a view, which is only valid in the handler.
+		// @param nconsumed, the bytes used by the decoded messages, the rest are kept in the
+		//		connection buffer and passed again together with the next bytes read.
+		virtual error_t decode(const char* data, size_t len, size_t* nconsumed, const MessageHandler& handler) = 0;
+		// Append the iovecs of one message to out, the referenced memory must stay
+		// valid until out is written.
+		virtual error_t encode(const void* data, size_t len, IovecList& out) = 0;
+		// The bytes of the message at the head of data, when it's known before the message
+		// is complete, so the connection buffer grows once for a large message, and the
+		// message is not decoded again until the bytes are read.
+		// @return 0 if unknown.
+		virtual size_t frame_size_hint(const char* /*data*/, size_t /*len*/) { return 0; }
+		// The IProtoCodec it adapts, whose vectors are moved to the readers of vectors.
+		virtual IProtoCodec* proto_codec() { return nullptr; }
+	};
+
+	// Use the IProtoCodec as IStreamCodec, the decoded vector is viewed and the
+	// encoded vector is held by the iovecs, so there is no extra copy.
+	class ProtoCodecAdapter :public IStreamCodec {
+	public:
+		explicit ProtoCodecAdapter(IProtoCodec* codec) :codec_(codec) {}
+
+		virtual error_t decode(const char* data, size_t len, size_t* nconsumed, const MessageHandler& handler) override {
+			return codec_->decode_partial((unsigned char*)data, len, nconsumed, [&](std::vector<unsigned char>&& v) {
+				handler(std::string_view((const char*)v.data(), v.size()));
+				});
+		}
+
+		virtual error_t encode(const void* data, size_t len, IovecList& out) override {
+			return codec_->encode((unsigned char*)data, len, [&](std::vector<unsigned char>&& v) {
+				out.append(std::move(v));
+				});
+		}
+
+		virtual IProtoCodec* proto_codec() override { return codec_; }
+
+	private:
+		IProtoCodec* codec_;
+	};
+
+	// The codec without framing, all bytes read is a message and the message is written as is.
+	class RawCodec :public IStreamCodec {
+	public:
+		virtual error_t decode(const char* data, size_t len, size_t* nconsumed, const MessageHandler& handler) override {
+			*nconsumed = len;
+			handler(std::string_view(data, len));
+			return error_ok;
+		}
+
+		virtual error_t encode(const void* data, size_t len, IovecList& out) override {
+			out.append(data, len);
+			return error_ok;
+		}
+	};
+
+	// The codec of the frames prefixed by the length of the payload, in 2, 4 or 8 bytes of
+	// big or little endian. All complete frames in the buffer are decoded by one read, and a
+	// frame larger than the max is rejected once its prefix arrives.
+	class LengthFieldCodec :public IStreamCodec {
+	public:
+		enum class endian {
+			big,
+			little,
+		};
+
+		// @param length_size, the bytes of the prefix, 2, 4 or 8, the others are taken as 4.
+		// @param max_frame_size, the max bytes of the payload.
+		LengthFieldCodec(int length_size = 4, endian order = endian::big, size_t max_frame_size = LENGTH_FIELD_MAX_FRAME_SIZE)
+			:length_size_(length_size == 2 || length_size == 8 ? length_size : 4), order_(order), max_frame_size_(max_frame_size) {}
+
+		virtual error_t decode(const char* data, size_t len, size_t* nconsumed, const MessageHandler& handler) override {
+			error_t err;
+			size_t pos = 0;
+			while (len - pos >= (size_t)length_size_) {
+				uint64_t size = get_length(data + pos);
+				if (size > max_frame_size_) {
+					return error_new(ERROR_READER_BUFFER_OVERFLOW, "frame %llu exceed max %d", (unsigned long long)size, (int)max_frame_size_);
+				}
+				if (len - pos - length_size_ < size) {
+					break;
+				}
+				handler(std::string_view(data + pos + length_size_, (size_t)size));
+				pos += length_size_ + (size_t)size;
+			}
+			*nconsumed = pos;
+			return err;
+		}
+
+		// The prefix is copied and the payload is referenced.
+		virtual error_t encode(const void* data, size_t len, IovecList& out) override {
+			if (len > max_frame_size_ || (length_size_ == 2 && len > 0xffff) || (length_size_ == 4 && len > 0xffffffff)) {
+				return error_new(ERROR_READER_BUFFER_OVERFLOW, "frame %d exceed max %d", (int)len, (int)max_frame_size_);
+			}
+
+			unsigned char prefix[8];
+			for (int i = 0; i < length_size_; i++) {
+				int shift = order_ == endian::big ? (length_size_ - 1 - i) * 8 : i * 8;
+				prefix[i] = (unsigned char)((uint64_t)len >> shift);
+			}
+			out.append_copy(prefix, length_size_);
+			out.append(data, len);
+			return error_ok;
+		}
+
+		virtual size_t frame_size_hint(const char* data, size_t len) override {
+			if (len < (size_t)length_size_) {
+				return 0;
+			}
+			uint64_t size = get_length(data);
+			return size > max_frame_size_ ? 0 : length_size_ + (size_t)size;
+		}
+
+	private:
+		uint64_t get_length(const char* data) const {
+			const unsigned char* p = (const unsigned char*)data;
+			uint64_t v = 0;
+			for (int i = 0; i < length_size_; i++) {
+				int shift = order_ == endian::big ? (length_size_ - 1 - i) * 8 : i * 8;
+				v |= (uint64_t)p[i] << shift;
+			}
+			return v;
+		}
+
+	private:
+		int length_size_;
+		endian order_;
+		size_t max_frame_size_;
 	};
+
 	template<typename Server>
-	class TcpConnection :public std::enable_shared_from_this<TcpConnection<Server>> {
+	class TcpConnection :public std::enable_shared_from_this<TcpConnection<Server>>, public TimerNode, public __detail::pending_output {
+		friend Server;
 	public:
-		TcpConnection(SocketPtr sock, IProtoCodec* codec, Server* svr) :sock_(sock), codec_(codec), svr_(svr) {}
+		TcpConnection(SocketPtr sock, IStreamCodec* codec, Server* svr) :sock_(sock), codec_(codec), svr_(svr) {}
 
 		~TcpConnection() {
 			LOG(TRACE) << "~TcpConnection";
 		}
 
+		// The id in the server, stable for the lifetime of the connection.
+		uint64_t id() const { return id_; }
+
+		// Interrupt the handler when the connection is idle, or check it again later if
+		// it's active after the timer is added, so the reads and writes only touch it.
+		virtual void on_timeout() override {
+			utime_t idle = svr_->wheel_.now() - last_active_;
+			if (idle < svr_->idle_timeout_) {
+				svr_->wheel_.add(this, svr_->idle_timeout_ - idle);
+				return;
+			}
+
+			LOG(TRACE) << "connection " << id_ << " idle " << u2ms(idle) << "ms, interrupt it";
+			co_.terminate();
+		}
+
+		// Read the next batch of messages, every complete message in the buffer is passed
+		// to the handler as a view into the buffer, which is only valid in the handler.
+		// @remark Don't read the connection in the handler.
+		error_t read(const MessageHandler& handler) {
+			return read_batch([&](const char* data, size_t len, size_t* nconsumed, int* got) {
+				return codec_->decode(data, len, nconsumed, [&](std::string_view msg) {
+					(*got)++;
+					ST_TRACE_SPAN("handler", "net");
+					handler(msg);
+					});
+				});
+		}
+
+		// Read the next message, the messages after it are kept for the next read. The
+		// vectors of an IProtoCodec are moved, the others are copied from the views.
 		error_t read(std::vector<unsigned char>& data) {
 			error_t err;
-			ssize_t nread = 0;
-			char buf[4096];
-			err = sock_->read(buf, 4096, &nread);
-			err = codec_->decode((unsigned char*)buf, nread, [&](std::vector<unsigned char>&& v) {
-				data = std::move(v);
+			if (!queued_.empty()) {
+				data = std::move(queued_.front());
+				queued_.pop_front();
+				return err;
+			}
+
+			IProtoCodec* proto = codec_->proto_codec();
+			if (!proto) {
+				err = read([&](std::string_view msg) {
+					queued_.emplace_back(msg.begin(), msg.end());
+					});
+				if (err) {
+					return error_trace(err);
+				}
+				data = std::move(queued_.front());
+				queued_.pop_front();
+				return err;
+			}
+
+			bool first = true;
+			err = read_batch([&](const char* p, size_t len, size_t* nconsumed, int* got) {
+				return proto->decode_partial((unsigned char*)p, len, nconsumed, [&](std::vector<unsigned char>&& v) {
+					(*got)++;
+					if (first) {
+						data = std::move(v);
+						first = false;
+					}
+					else {
+						queued_.push_back(std::move(v));
+					}
+					});
 				});
+			if (err) {
+				return error_trace(err);
+			}
 			return err;
 		}
 
+		// Encode and write one message, or gather it when the output is corked.
 		error_t write(void* buf, size_t size) {
+			ST_TRACE_SPAN("conn.write", "net");
+			error_t err;
+			int from = out_.count();
+			{
+				ST_TRACE_SPAN("encode", "net");
+				if ((err = codec_->encode(buf, size, out_)) != error_ok) {
+					return error_trace(err);
+				}
+			}
+			__detail::builtin_metrics::get().tcp_messages_written.inc();
+
+			// Write the gathered and this message by one writev, without copy.
+			if (!cork_ || out_.bytes() >= cork_max_bytes_ || out_.count() >= cork_max_count_) {
+				if ((err = flush()) != error_ok) {
+					return error_trace(err);
+				}
+				return err;
+			}
+
+			// The caller may release buf once we return.
+			out_.retain(from);
+			return err;
+		}
+
+		// Write the iovecs as is, without the codec, the list is cleared when done.
+		error_t writev(IovecList& iovs) {
 			error_t err;
-			err = codec_->encode((unsigned char*)buf, size, [&](std::vector<unsigned char>&& v) {
+			if (&iovs != &out_ && (err = flush()) != error_ok) {
+				return error_trace(err);
+			}
+
+			ST_TRACE_SPAN("socket.writev", "net");
+			const iovec* iov = iovs.iov();
+			int count = iovs.count();
+			while (count > 0) {
+				int n = std::min(count, IOV_MAX);
 				ssize_t nwrite = 0;
-				err = sock_->write(v.data(), v.size(), &nwrite);
-				});
+				if ((err = sock_->writev(iov, n, &nwrite)) != error_ok) {
+					iovs.clear();
+					return error_trace(err);
+				}
+				iov += n;
+				count -= n;
+			}
+			last_active_ = svr_->wheel_.now();
+			iovs.clear();
+			return err;
+		}
+
+		// Send the file as is, without the codec, after the gathered messages.
+		// @param nwrite, the actual sent bytes, ignore if NULL.
+		error_t sendfile(int fd, off_t offset, size_t len, ssize_t* nwrite = NULL) {
+			error_t err;
+			if ((err = flush()) != error_ok) {
+				return error_trace(err);
+			}
+
+			ST_TRACE_SPAN("socket.sendfile", "net");
+			err = sock_->sendfile(fd, offset, len, nwrite);
+			last_active_ = svr_->wheel_.now();
+			if (err) {
+				return error_trace(err);
+			}
 			return err;
 		}
 
+		// Cork the output, the written messages are gathered and sent by one writev when
+		// the connection is about to block on reading, when the gathered bytes or messages
+		// reach the thresholds, on flush or when the handler returns. The handler also
+		// flushes before it blocks in the helpers, the sleep, the conds, the channels,
+		// run_blocking, resolving and leasing from a ConnectionPool.
+		// @remark Call flush when writing from a coroutine other than the handler, or before
+		//		blocking on the raw ST calls, which leave the output gathered meanwhile.
+		void set_cork(bool on, size_t max_bytes = CONNECTION_CORK_MAX_BYTES, int max_count = CONNECTION_CORK_MAX_COUNT) {
+			cork_ = on;
+			cork_max_bytes_ = max_bytes;
+			cork_max_count_ = max_count;
+		}
+
+		// Write the gathered messages before the handler blocks, a failed write is logged,
+		// and the socket fails the next read or write.
+		virtual void flush_pending() override {
+			error_t err = flush();
+			if (err) {
+				LOG(TRACE) << err->what();
+			}
+		}
+
+		// Write the gathered messages now.
+		error_t flush() {
+			error_t err;
+			if (out_.empty()) {
+				return err;
+			}
+
+			if ((err = writev(out_)) != error_ok) {
+				return error_trace(err);
+			}
+			return err;
+		}
+
+		// The max bytes of a partial message, fail the read when exceed.
+		void set_max_buffer_size(size_t size) { max_buffer_size_ = size; }
+
 		void onNewConnection(TcpConnectionHandler handler) {
 			//LOG(TRACE) << "accept new client...";
-			co_ = st::coroutine(0,
+			coroutine::attributes attr;
+			attr.stack_size = svr_->stack_size_;
+			co_ = st::coroutine(attr,
 				[this](TcpConnectionHandler handler)
 				{
+					__detail::bind_output(this);
 					handler(this->shared_from_this());
-					svr_->removeConnecttion(this->shared_from_this());
+					__detail::bind_output(nullptr);
+					error_t err = flush();
+					if (err) {
+						LOG(TRACE) << err->what();
+					}
+					svr_->removeConnecttion(id_);
 				},
 				handler);
 		}
 
+	private:
+		// Read until a batch of messages is decoded, decode(data, len, nconsumed, got)
+		// decodes the messages at the head of the buffer and counts them to got.
+		template<typename Decode>
+		error_t read_batch(const Decode& decode) {
+			ST_TRACE_SPAN("conn.read", "net");
+			error_t err;
+			while (true) {
+				int got = 0;
+				while (!in_.empty()) {
+					size_t nconsumed = 0;
+					{
+						ST_TRACE_SPAN("decode", "net");
+						err = decode(in_.data(), in_.size(), &nconsumed, &got);
+					}
+					if (err) {
+						return error_trace(err);
+					}
+
+					in_.consume(nconsumed);
+
+					// Need more bytes for a complete message.
+					if (nconsumed == 0) {
+						break;
+					}
+				}
+
+				if (got) {
+					__detail::builtin_metrics::get().tcp_messages_read.inc(got);
+					return err;
+				}
+
+				if ((err = fill()) != error_ok) {
+					return error_trace(err);
+				}
+			}
+		}
+
+		// Append the bytes read from the socket to the buffer, read as much as the buffer
+		// can hold, which grows when a message doesn't fit in it. Keep reading until the
+		// hinted bytes of the partial message are in the buffer.
+		error_t fill() {
+			error_t err;
+			// We are going to block, it's the end of a batch of corked messages.
+			if ((err = flush()) != error_ok) {
+				return error_trace(err);
+			}
+
+			if (in_.size() >= max_buffer_size_) {
+				return error_new(ERROR_READER_BUFFER_OVERFLOW, "buffer %d exceed max %d", (int)in_.size(), (int)max_buffer_size_);
+			}
+
+			// Reserve the rest of a large message once, instead of growing by the reads.
+			size_t hint = std::min(codec_->frame_size_hint(in_.data(), in_.size()), max_buffer_size_);
+			size_t rest = hint > in_.size() ? hint - in_.size() : 0;
+			in_.ensure_writable(std::max<size_t>(CONNECTION_READ_SIZE, rest));
+
+			ST_TRACE_SPAN("socket.read", "net");
+			do {
+				in_.ensure_writable(CONNECTION_READ_SIZE);
+				size_t size = std::min(in_.writable(), max_buffer_size_ - in_.size());
+				ssize_t nread = 0;
+				if ((err = sock_->read(in_.tail(), size, &nread)) != error_ok) {
+					return error_trace(err);
+				}
+				in_.commit(nread);
+				last_active_ = svr_->wheel_.now();
+			} while (in_.size() < hint);
+			return err;
+		}
+
 	protected:
 		SocketPtr sock_;
 		st::coroutine co_;
-		IProtoCodec* codec_;
+		IStreamCodec* codec_;
 		Server* svr_;
+		Buffer in_;
+		IovecList out_;
+		std::deque<std::vector<unsigned char>> queued_;
+		bool cork_ = false;
+		size_t cork_max_bytes_ = CONNECTION_CORK_MAX_BYTES;
+		int cork_max_count_ = CONNECTION_CORK_MAX_COUNT;
+		size_t max_buffer_size_ = CONNECTION_MAX_BUFFER_SIZE;
+		uint64_t id_ = 0;
+		// The time of the last read or write, by the clock of the timing wheel.
+		utime_t last_active_ = 0;
 	};
 
 	class TcpServer {
@@ -511,26 +1015,94 @@ namespace st {
 		friend TcpConnection<TcpServer>;
 		TcpServer(const char* host, int port) :acceptor_(host, port) {}
 
+		~TcpServer() {
+			stop();
+		}
+
+		TcpServer(const TcpServer&) = delete;
+		TcpServer& operator=(const TcpServer&) = delete;
+
 		error_t start() {
 			error_t err;
 			err = acceptor_.init();
 			if (err) {
 				return error_trace(err);
 			}
-			co_ = st::coroutine(0, &TcpServer::run, this);
+			exit_ = false;
+			started_ = true;
+			co_ = st::coroutine(1, &TcpServer::run, this);
+
+			if (idle_timeout_ > 0) {
+				wheel_.reset(idle_tick_, (utime_t)st_utime());
+				idolco_ = st::coroutine(1, &TcpServer::check_idle, this);
+			}
 			return error_ok;
 		}
 
+		// Stop accepting, close the listener, interrupt the handlers of the connections and
+		// wait for them to return, so the server can be destroyed then.
+		// @remark Must be called in the ST thread of the server, but not by its coroutines,
+		//		and blocks as long as a handler ignores the interrupt.
 		void stop() {
+			if (!started_) {
+				return;
+			}
+			started_ = false;
 			exit_ = true;
 			co_.terminate();
+			idolco_.terminate();
+
+			// Wait for the coroutines to quit, so the listener is not in use when closed.
+			{
+				st::coroutine accept(std::move(co_));
+				st::coroutine idle(std::move(idolco_));
+			}
+			acceptor_.close();
+
+			std::vector<TcpConnectionPtr> conns;
+			conns_.for_each([&](uint64_t, TcpConnectionPtr& conn) { conns.push_back(conn); });
+			for (auto& conn : conns) {
+				conn->co_.terminate();
+			}
+			conns.clear();
+
+			while (conns_.size() > 0) {
+				drained_.wait();
+			}
 		}
 
 		void onNewConnection(IProtoCodec* codec, TcpConnectionHandler handler) {
+			adapter_.reset(new ProtoCodecAdapter(codec));
+			onNewConnection(adapter_.get(), std::move(handler));
+		}
+
+		void onNewConnection(IStreamCodec* codec, TcpConnectionHandler handler) {
 			codec_ = codec;
 			handler_ = std::move(handler);
 		}
 
+		// The stack size of the connection coroutines, 0 for the default, see coroutine::stack_size_class.
+		void set_coroutine_stack_size(int size) { stack_size_ = size; }
+
+		// The max connections, the new connections are closed once reached, 0 for no limit.
+		void set_max_connections(int max) { max_connections_ = max; }
+
+		size_t connections() const { return conns_.size(); }
+
+		// Interrupt the handlers of the connections which have not read or written for the
+		// timeout. All connections are checked by one timing wheel of the tick in a coroutine,
+		// so the work per tick is constant. Must be called before start.
+		void set_idle_timeout(utime_t timeout, utime_t tick = SERVER_IDLE_TICK) {
+			idle_timeout_ = timeout;
+			idle_tick_ = tick;
+		}
+
+		// Find the connection by id, nullptr if it's closed.
+		TcpConnectionPtr connection(uint64_t id) {
+			TcpConnectionPtr* conn = conns_.get(id);
+			return conn ? *conn : nullptr;
+		}
+
 	private:
 		void run() {
 			while (!exit_) {
@@ -539,6 +1111,15 @@ namespace st {
 					continue;
 				}
 
+				if (max_connections_ > 0 && (int)conns_.size() >= max_connections_) {
+					error_t err = error_new(ERROR_EXCEED_CONNECTIONS, "drop fd=%d, max=%d, now=%d", st_netfd_fileno(nfd), max_connections_, (int)conns_.size());
+					LOG(WARNNING) << err->what();
+					__detail::close_stfd(nfd);
+					__detail::builtin_metrics::get().tcp_rejected.inc();
+					continue;
+				}
+
+				__detail::builtin_metrics::get().tcp_accepted.inc();
 				auto sock = SocketPtr(new Socket());
 				auto err = sock->initialize(nfd);
 				if (err) {
@@ -549,14 +1130,36 @@ namespace st {
 			}
 		}
 
+		void check_idle() {
+			while (!exit_) {
+				st_usleep(idle_tick_);
+				wheel_.advance((utime_t)st_utime());
+			}
+		}
+
 	private:
-		void removeConnecttion(TcpConnectionPtr conn) {
-			alive_cliconns_.erase(std::find(alive_cliconns_.begin(), alive_cliconns_.end(), conn));
+		void removeConnecttion(uint64_t id) {
+			TcpConnectionPtr* conn = conns_.get(id);
+			if (conn) {
+				wheel_.cancel(conn->get());
+				__detail::builtin_metrics& m = __detail::builtin_metrics::get();
+				m.tcp_closed.inc();
+				m.tcp_connections.sub(1);
+			}
+			conns_.erase(id);
+			if (exit_ && conns_.size() == 0) {
+				drained_.notify_all();
+			}
 		}
 
 		void addConnection(TcpConnectionPtr conn) {
+			conn->id_ = conns_.insert(conn);
+			conn->last_active_ = wheel_.now();
+			__detail::builtin_metrics::get().tcp_connections.add(1);
+			if (idle_timeout_ > 0) {
+				wheel_.add(conn.get(), idle_timeout_);
+			}
 			conn->onNewConnection(handler_);
-			alive_cliconns_.push_back(conn);
 		}
 
 	private:
@@ -564,8 +1167,161 @@ namespace st {
 		st::coroutine co_;					 //acceptЭ��
 		st::coroutine idolco_;
 		bool exit_ = false;
-		IProtoCodec* codec_;
+		bool started_ = false;
+		// Signaled when the last connection is removed after stop.
+		st::condition_variable drained_;
+		IStreamCodec* codec_;
+		std::unique_ptr<ProtoCodecAdapter> adapter_;
+		TcpConnectionHandler handler_;
+		int stack_size_ = 0;
+		int max_connections_ = 0;
+		SlotMap<TcpConnectionPtr> conns_; //client co
+		utime_t idle_timeout_ = 0;
+		utime_t idle_tick_ = SERVER_IDLE_TICK;
+		TimingWheel wheel_;
+	};
+
+	// Run one TcpServer per OS thread, each thread owns its own ST scheduler,
+	// listener, accept coroutine and connections. All listeners bind the same
+	// port with SO_REUSEPORT, so the kernel spreads new connections over workers.
+	// @remark The codec is shared by all workers, it must be stateless.
+	class TcpServerGroup {
+	public:
+		// @param workers, the number of worker threads, 0 for one per cpu core.
+		TcpServerGroup(const char* host, int port, int workers = 0) :host_(host), port_(port) {
+			workers_ = workers > 0 ? workers : (int)std::thread::hardware_concurrency();
+			if (workers_ <= 0) {
+				workers_ = 1;
+			}
+		}
+
+		~TcpServerGroup() {
+			stop();
+		}
+
+		TcpServerGroup(const TcpServerGroup&) = delete;
+		TcpServerGroup& operator=(const TcpServerGroup&) = delete;
+
+		// Must be called before start, every worker gets a copy of the handler.
+		void onNewConnection(IProtoCodec* codec, TcpConnectionHandler handler) {
+			adapter_.reset(new ProtoCodecAdapter(codec));
+			onNewConnection(adapter_.get(), std::move(handler));
+		}
+
+		void onNewConnection(IStreamCodec* codec, TcpConnectionHandler handler) {
+			codec_ = codec;
+			handler_ = std::move(handler);
+		}
+
+		// Called in each worker thread to setup its server before it starts, for example
+		// to set the stack size or reserve the stacks.
+		void onWorkerInit(std::function<void(int index, TcpServer& svr)> fn) {
+			init_ = std::move(fn);
+		}
+
+		// Pin the worker i to the cpu core i % ncpus, must be called before start.
+		void set_cpu_affinity(bool on) { affinity_ = on; }
+
+		int workers() const { return workers_; }
+
+		// Start all workers and wait for their listeners, fail if any worker fails.
+		error_t start() {
+			exit_ = false;
+			std::vector<std::future<error_t>> ready;
+			for (int i = 0; i < workers_; i++) {
+				std::promise<error_t> promise;
+				ready.push_back(promise.get_future());
+				threads_.emplace_back(&TcpServerGroup::worker, this, i, std::move(promise));
+			}
+
+			error_t err;
+			for (auto& it : ready) {
+				error_t r = it.get();
+				if (r && !err) {
+					err = r;
+				}
+			}
+
+			if (err) {
+				stop();
+				return error_trace(err);
+			}
+			return error_ok;
+		}
+
+		// Stop all workers and wait for the threads to quit.
+		void stop() {
+			exit_ = true;
+			for (auto& it : threads_) {
+				if (it.joinable()) {
+					it.join();
+				}
+			}
+			threads_.clear();
+		}
+
+	private:
+		void worker(int index, std::promise<error_t> ready) {
+			if (affinity_) {
+				set_affinity(index);
+			}
+
+			error_t err = enable_coroutine();
+			if (err) {
+				// Move the only reference to the thread of start, the refs are not atomic.
+				error_trace(err);
+				ready.set_value(std::move(err));
+				return;
+			}
+
+			TcpServer svr(host_.c_str(), port_);
+			svr.onNewConnection(codec_, handler_);
+			if (init_) {
+				init_(index, svr);
+			}
+			if ((err = svr.start()) != error_ok) {
+				error_trace(err);
+				ready.set_value(std::move(err));
+				return;
+			}
+			ready.set_value(error_ok);
+			LOG(TRACE) << "worker " << index << " listen on " << host_ << ":" << port_;
+
+			// The stop flag is set by another OS thread, which can not wake a
+			// coroutine of this scheduler, so we poll it.
+			while (!exit_) {
+				st_usleep(SERVER_GROUP_CHECK_INTERVAL);
+			}
+
+			// Close the listener, so it leaves the reuseport group, and wait for the
+			// handlers to return, which closes the connections before the scheduler quits.
+			svr.stop();
+		}
+
+		static void set_affinity(int index) {
+			int ncpus = (int)std::thread::hardware_concurrency();
+			if (ncpus <= 0) {
+				return;
+			}
+
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(index % ncpus, &set);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+				LOG(WARNNING) << "set affinity failed for worker " << index;
+			}
+		}
+
+	private:
+		std::string host_;
+		int port_;
+		int workers_;
+		bool affinity_ = false;
+		std::atomic<bool> exit_{ false };
+		IStreamCodec* codec_ = nullptr;
+		std::unique_ptr<ProtoCodecAdapter> adapter_;
 		TcpConnectionHandler handler_;
-		std::vector<TcpConnectionPtr> alive_cliconns_; //client co
+		std::function<void(int, TcpServer&)> init_;
+		std::vector<std::thread> threads_;
 	};
 }
\ No newline at end of file
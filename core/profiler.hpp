@@ -0,0 +1,210 @@
+#pragma once
+#include <st.h>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "coroutine.hpp"
+
+// The default run slice to warn, in microseconds.
+#define PROFILER_SLICE_THRESHOLD (10 * 1000)
+
+namespace st {
+	// The opt-in profiler of the coroutines of the current ST thread, which records the run
+	// time, the switches and the longest run slice of each coroutine by the switch hooks, and
+	// warns when a slice exceeds the threshold, for example a handler does CPU work without
+	// yielding. The coroutines of the same name are reported together.
+	// @remark The hooks cost two clock reads per switch, only when it's started.
+	class Profiler {
+	public:
+		struct Entry {
+			std::string name;
+			// The coroutines of the name, live and quit.
+			uint64_t coroutines;
+			uint64_t switches;
+			// In microseconds.
+			int64_t run_time;
+			int64_t max_slice;
+		};
+
+		static Profiler& instance() {
+			static thread_local Profiler profiler;
+			return profiler;
+		}
+
+		Profiler(const Profiler&) = delete;
+		Profiler& operator=(const Profiler&) = delete;
+
+		// @param threshold, the run slice to warn in microseconds, 0 to never warn.
+		void start(int64_t threshold = PROFILER_SLICE_THRESHOLD) {
+			threshold_ = threshold * 1000;
+			if (running_) {
+				return;
+			}
+
+			if (key_ < 0 && st_key_create(&key_, &Profiler::on_exit) != 0) {
+				key_ = -1;
+				return;
+			}
+			__detail::switch_hooks::add(&Profiler::on_switch_in, &Profiler::on_switch_out);
+			running_ = true;
+		}
+
+		void stop() {
+			if (running_) {
+				__detail::switch_hooks::remove(&Profiler::on_switch_in, &Profiler::on_switch_out);
+				running_ = false;
+			}
+		}
+
+		bool running() const { return running_; }
+
+		// Clear the stats of the live and the quit coroutines.
+		void reset() {
+			for (record* r = live_.next; r != &live_; r = r->next) {
+				r->switches = 0;
+				r->run_time = 0;
+				r->max_slice = 0;
+			}
+			quit_.clear();
+		}
+
+		// The top n entries by the run time.
+		std::vector<Entry> top(size_t n = 10) {
+			std::unordered_map<std::string, Entry> entries = quit_;
+			for (record* r = live_.next; r != &live_; r = r->next) {
+				std::string name = name_of(r);
+				Entry& e = entries[name];
+				e.name = name;
+				e.coroutines++;
+				merge(e, r);
+			}
+
+			std::vector<Entry> v;
+			for (auto& it : entries) {
+				v.push_back(it.second);
+				v.back().run_time /= 1000;
+				v.back().max_slice /= 1000;
+			}
+			std::sort(v.begin(), v.end(), [](const Entry& a, const Entry& b) { return a.run_time > b.run_time; });
+			if (v.size() > n) {
+				v.resize(n);
+			}
+			return v;
+		}
+
+		// The report of the top n entries, one per line.
+		std::string report(size_t n = 10) {
+			std::string s = "name coroutines switches run_time(us) max_slice(us)\n";
+			char buf[256];
+			for (auto& e : top(n)) {
+				snprintf(buf, sizeof(buf), "%s %llu %llu %lld %lld\n", e.name.c_str(), (unsigned long long)e.coroutines,
+					(unsigned long long)e.switches, (long long)e.run_time, (long long)e.max_slice);
+				s += buf;
+			}
+			return s;
+		}
+
+	private:
+		Profiler() {
+			live_.prev = live_.next = &live_;
+		}
+
+		// The stats of a coroutine, in nanoseconds.
+		struct record {
+			record* prev = nullptr;
+			record* next = nullptr;
+			st_thread_t id = nullptr;
+			const char* name = nullptr;
+			uint64_t switches = 0;
+			int64_t run_time = 0;
+			int64_t max_slice = 0;
+			// 0 when it's not running.
+			int64_t slice_start = 0;
+		};
+
+		static int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		static std::string name_of(record* r) {
+			if (r->name) {
+				return r->name;
+			}
+			char buf[32];
+			snprintf(buf, sizeof(buf), "coroutine-%lx", (unsigned long)(uintptr_t)r->id);
+			return buf;
+		}
+
+		static void merge(Entry& e, record* r) {
+			e.switches += r->switches;
+			e.run_time += r->run_time;
+			e.max_slice = std::max(e.max_slice, r->max_slice);
+		}
+
+		static void on_switch_in() {
+			Profiler& p = instance();
+			record* r = (record*)st_thread_getspecific(p.key_);
+			if (!r) {
+				r = new record();
+				r->id = st_thread_self();
+				r->prev = p.live_.prev;
+				r->next = &p.live_;
+				p.live_.prev->next = r;
+				p.live_.prev = r;
+				st_thread_setspecific(p.key_, r);
+			}
+			r->switches++;
+			r->slice_start = now();
+		}
+
+		static void on_switch_out() {
+			Profiler& p = instance();
+			record* r = (record*)st_thread_getspecific(p.key_);
+			if (!r || r->slice_start == 0) {
+				return;
+			}
+
+			int64_t slice = now() - r->slice_start;
+			r->slice_start = 0;
+			r->run_time += slice;
+			r->max_slice = std::max(r->max_slice, slice);
+			r->name = this_coroutine::name();
+
+			if (p.threshold_ > 0 && slice > p.threshold_) {
+				LOG(WARNNING) << "coroutine " << name_of(r) << " ran " << slice / 1000 << "us without yielding";
+			}
+		}
+
+		// Called when the coroutine quits, the stats go to the entry of the name, and the
+		// unnamed ones go to one entry.
+		static void on_exit(void* p) {
+			record* r = (record*)p;
+			if (r->slice_start) {
+				r->run_time += now() - r->slice_start;
+			}
+			if (!r->name) {
+				r->name = this_coroutine::name();
+			}
+			r->prev->next = r->next;
+			r->next->prev = r->prev;
+
+			std::string name = r->name ? r->name : "<unnamed>";
+			Entry& e = instance().quit_[name];
+			e.name = name;
+			e.coroutines++;
+			merge(e, r);
+			delete r;
+		}
+
+	private:
+		int key_ = -1;
+		bool running_ = false;
+		int64_t threshold_ = 0;
+		// The sentinel of the live records.
+		record live_;
+		std::unordered_map<std::string, Entry> quit_;
+	};
+}
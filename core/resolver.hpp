@@ -0,0 +1,300 @@
+#pragma once
+#include <st.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "coroutine.hpp"
+#include "consts.hpp"
+#include "error.hpp"
+#include "blocking.hpp"
+
+// The time to cache the addresses, and the failures.
+#define RESOLVER_TTL (60 * 1000000LL)
+#define RESOLVER_NEGATIVE_TTL (5 * 1000000LL)
+// The max names cached by a resolver.
+#define RESOLVER_MAX_CACHE 4096
+
+namespace st {
+	// The same as net.hpp, which depends on the resolver.
+	typedef int64_t utime_t;
+
+	// An address of a name, the port is 0 until set_port.
+	struct ResolvedAddress {
+		sockaddr_storage addr;
+		socklen_t addrlen;
+
+		int family() const { return addr.ss_family; }
+
+		void set_port(int port) {
+			if (addr.ss_family == AF_INET) {
+				((sockaddr_in*)&addr)->sin_port = htons((uint16_t)port);
+			}
+			else if (addr.ss_family == AF_INET6) {
+				((sockaddr_in6*)&addr)->sin6_port = htons((uint16_t)port);
+			}
+		}
+
+		// Parse the numeric ipv4 or ipv6 address, return false if it's not.
+		static bool parse(const std::string& ip, ResolvedAddress* out) {
+			memset(out, 0, sizeof(*out));
+			sockaddr_in* in = (sockaddr_in*)&out->addr;
+			if (inet_pton(AF_INET, ip.c_str(), &in->sin_addr) == 1) {
+				in->sin_family = AF_INET;
+				out->addrlen = sizeof(sockaddr_in);
+				return true;
+			}
+
+			sockaddr_in6* in6 = (sockaddr_in6*)&out->addr;
+			if (inet_pton(AF_INET6, ip.c_str(), &in6->sin6_addr) == 1) {
+				in6->sin6_family = AF_INET6;
+				out->addrlen = sizeof(sockaddr_in6);
+				return true;
+			}
+			return false;
+		}
+	};
+
+	// The backend to look up a name, which is called in the blocking pool, so it may block.
+	class IResolverBackend {
+	public:
+		virtual ~IResolverBackend() {}
+		virtual error_t lookup(const std::string& host, std::vector<ResolvedAddress>& addrs) = 0;
+	};
+
+	class GetaddrinfoBackend :public IResolverBackend {
+	public:
+		virtual error_t lookup(const std::string& host, std::vector<ResolvedAddress>& addrs) override {
+			addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = AI_ADDRCONFIG;
+
+			addrinfo* r = NULL;
+			int ret = getaddrinfo(host.c_str(), NULL, &hints, &r);
+			if (ret != 0) {
+				return error_new(ERROR_SYSTEM_DNS_RESOLVE, "getaddrinfo %s, %s", host.c_str(), gai_strerror(ret));
+			}
+
+			for (addrinfo* p = r; p; p = p->ai_next) {
+				ResolvedAddress addr;
+				memset(&addr, 0, sizeof(addr));
+				memcpy(&addr.addr, p->ai_addr, std::min((size_t)p->ai_addrlen, sizeof(addr.addr)));
+				addr.addrlen = p->ai_addrlen;
+				addrs.push_back(addr);
+			}
+			freeaddrinfo(r);
+
+			if (addrs.empty()) {
+				return error_new(ERROR_SYSTEM_DNS_RESOLVE, "getaddrinfo %s, no address", host.c_str());
+			}
+			return error_ok;
+		}
+	};
+
+	// The resolver of the current ST thread. The lookups run in the blocking pool, and
+	// only the waiting coroutines are parked, the result is cached for the ttl and the
+	// failure for the negative ttl. The concurrent lookups of a name share one lookup.
+	// The static hosts and numeric addresses never go to the backend, and the backend
+	// can be replaced, for example by a fake one in the tests.
+	class Resolver {
+	public:
+		Resolver() :backend_(std::make_shared<GetaddrinfoBackend>()) {}
+
+		Resolver(const Resolver&) = delete;
+		Resolver& operator=(const Resolver&) = delete;
+
+		static Resolver& instance() {
+			static thread_local Resolver resolver;
+			return resolver;
+		}
+
+		void set_backend(std::shared_ptr<IResolverBackend> backend) { backend_ = std::move(backend); }
+
+		void set_ttl(utime_t ttl, utime_t negative_ttl = RESOLVER_NEGATIVE_TTL) {
+			ttl_ = ttl;
+			negative_ttl_ = negative_ttl;
+		}
+
+		// Map the name to the ip, like an entry of /etc/hosts.
+		error_t add_host(const std::string& name, const std::string& ip) {
+			ResolvedAddress addr;
+			if (!ResolvedAddress::parse(ip, &addr)) {
+				return error_new(ERROR_SYSTEM_IP_INVALID, "invalid ip %s for %s", ip.c_str(), name.c_str());
+			}
+			hosts_[name].push_back(addr);
+			return error_ok;
+		}
+
+		// Load the static hosts from a file in the /etc/hosts format.
+		error_t load_hosts(const char* path = "/etc/hosts") {
+			std::ifstream f(path);
+			if (!f.is_open()) {
+				return error_new(ERROR_SYSTEM_FILE_OPENE, "open %s", path);
+			}
+
+			std::string line;
+			while (std::getline(f, line)) {
+				line = line.substr(0, line.find('#'));
+				std::istringstream ss(line);
+				std::string ip, name;
+				if (!(ss >> ip)) {
+					continue;
+				}
+
+				ResolvedAddress addr;
+				if (!ResolvedAddress::parse(ip, &addr)) {
+					continue;
+				}
+				while (ss >> name) {
+					hosts_[name].push_back(addr);
+				}
+			}
+			return error_ok;
+		}
+
+		// Drop the cached results.
+		void clear_cache() { cache_.clear(); }
+
+		// Resolve the name to the addresses, park the coroutine until the lookup is done.
+		// @param timeout, the max time to wait, the lookup goes on and is cached after it.
+		error_t resolve(const std::string& host, std::vector<ResolvedAddress>& addrs, utime_t timeout = ST_UTIME_NO_TIMEOUT) {
+			addrs.clear();
+
+			ResolvedAddress numeric;
+			if (ResolvedAddress::parse(host, &numeric)) {
+				addrs.push_back(numeric);
+				return error_ok;
+			}
+
+			auto host_it = hosts_.find(host);
+			if (host_it != hosts_.end()) {
+				addrs = host_it->second;
+				return error_ok;
+			}
+
+			auto cache_it = cache_.find(host);
+			if (cache_it != cache_.end()) {
+				if ((utime_t)st_utime() < cache_it->second.expires) {
+					if (cache_it->second.addrs.empty()) {
+						return error_new(ERROR_SYSTEM_DNS_RESOLVE, "resolve %s, %s (cached)", host.c_str(), cache_it->second.reason.c_str());
+					}
+					addrs = cache_it->second.addrs;
+					return error_ok;
+				}
+				cache_.erase(cache_it);
+			}
+
+			std::shared_ptr<flight> f;
+			auto flight_it = inflight_.find(host);
+			if (flight_it != inflight_.end()) {
+				f = flight_it->second;
+			}
+			else {
+				f = std::make_shared<flight>();
+				inflight_[host] = f;
+				st::coroutine(0, &Resolver::lookup, this, host, f);
+			}
+
+			__detail::flush_output();
+			while (!f->done) {
+				if (st_cond_timedwait(f->cond.native_handle(), timeout) == -1 && !f->done) {
+					if (errno == ETIME) {
+						return error_new(ERROR_SOCKET_TIMEOUT, "resolve %s timeout %d ms", host.c_str(), (int)(timeout / 1000));
+					}
+					return error_new(ERROR_THREAD_INTERRUPED, "resolve %s interrupted", host.c_str());
+				}
+			}
+
+			if (f->addrs.empty()) {
+				return error_new(ERROR_SYSTEM_DNS_RESOLVE, "resolve %s, %s", host.c_str(), f->reason.c_str());
+			}
+			addrs = f->addrs;
+			return error_ok;
+		}
+
+	private:
+		// The lookup shared by the coroutines resolving the same name.
+		struct flight {
+			st::condition_variable cond;
+			bool done = false;
+			std::vector<ResolvedAddress> addrs;
+			std::string reason;
+		};
+
+		struct entry {
+			// Empty for a failure.
+			std::vector<ResolvedAddress> addrs;
+			std::string reason;
+			utime_t expires;
+		};
+
+		// Run the lookup in the blocking pool in this coroutine, so the waiters can give up
+		// by their timeouts.
+		void lookup(std::string host, std::shared_ptr<flight> f) {
+			// The lookup owns its data, it may outlive this coroutine.
+			std::shared_ptr<IResolverBackend> backend = backend_;
+			auto addrs = std::make_shared<std::vector<ResolvedAddress>>();
+			error_t err = this_coroutine::run_blocking([backend, host, addrs]() {
+				return backend->lookup(host, *addrs);
+				});
+
+			if (err) {
+				complete(host, f, std::vector<ResolvedAddress>(), err->desc());
+			}
+			else {
+				complete(host, f, std::move(*addrs), "");
+			}
+		}
+
+		void complete(const std::string& host, std::shared_ptr<flight> f, std::vector<ResolvedAddress> addrs, const std::string& reason) {
+			if (cache_.size() >= RESOLVER_MAX_CACHE) {
+				expire();
+			}
+
+			utime_t ttl = addrs.empty() ? negative_ttl_ : ttl_;
+			if (ttl > 0) {
+				cache_[host] = entry{ addrs, reason, (utime_t)st_utime() + ttl };
+			}
+
+			f->addrs = std::move(addrs);
+			f->reason = reason;
+			f->done = true;
+			inflight_.erase(host);
+			f->cond.notify_all();
+		}
+
+		// Drop the expired entries, or all if none is expired.
+		void expire() {
+			utime_t now = (utime_t)st_utime();
+			for (auto it = cache_.begin(); it != cache_.end();) {
+				if (now >= it->second.expires) {
+					it = cache_.erase(it);
+				}
+				else {
+					++it;
+				}
+			}
+
+			if (cache_.size() >= RESOLVER_MAX_CACHE) {
+				cache_.clear();
+			}
+		}
+
+	private:
+		std::shared_ptr<IResolverBackend> backend_;
+		utime_t ttl_ = RESOLVER_TTL;
+		utime_t negative_ttl_ = RESOLVER_NEGATIVE_TTL;
+		std::unordered_map<std::string, std::vector<ResolvedAddress>> hosts_;
+		std::unordered_map<std::string, entry> cache_;
+		std::unordered_map<std::string, std::shared_ptr<flight>> inflight_;
+	};
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace st {
+	// The slot map, insert, erase and lookup by id are O(1). The id is the slot index and
+	// the generation of the slot, which changes when the slot is erased, so a stale id
+	// never matches the element inserted to the same slot later.
+	template<typename T>
+	class SlotMap {
+	public:
+		typedef uint64_t id_type;
+		// No element has this id.
+		static const id_type npos = 0;
+
+		SlotMap() :size_(0) {}
+
+		id_type insert(T value) {
+			uint32_t index;
+			if (!free_.empty()) {
+				index = free_.back();
+				free_.pop_back();
+			}
+			else {
+				index = (uint32_t)slots_.size();
+				slots_.emplace_back();
+			}
+
+			slot& it = slots_[index];
+			it.value = std::move(value);
+			it.used = true;
+			size_++;
+			return make_id(index, it.generation);
+		}
+
+		// Erase the element, return false if the id is stale.
+		bool erase(id_type id) {
+			slot* it = find(id);
+			if (!it) {
+				return false;
+			}
+
+			it->value = T();
+			it->used = false;
+			it->generation++;
+			free_.push_back((uint32_t)(id & 0xFFFFFFFF));
+			size_--;
+			return true;
+		}
+
+		// Get the element, nullptr if the id is stale.
+		T* get(id_type id) {
+			slot* it = find(id);
+			return it ? &it->value : nullptr;
+		}
+
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+
+		// Call f(id, value) for each element, which must not insert or erase.
+		template<typename F>
+		void for_each(F f) {
+			for (size_t i = 0; i < slots_.size(); i++) {
+				if (slots_[i].used) {
+					f(make_id((uint32_t)i, slots_[i].generation), slots_[i].value);
+				}
+			}
+		}
+
+	private:
+		struct slot {
+			T value;
+			// Starts from 1, so the id is never npos.
+			uint32_t generation = 1;
+			bool used = false;
+		};
+
+		static id_type make_id(uint32_t index, uint32_t generation) {
+			return ((id_type)generation << 32) | index;
+		}
+
+		slot* find(id_type id) {
+			uint32_t index = (uint32_t)(id & 0xFFFFFFFF);
+			if (index >= slots_.size()) {
+				return nullptr;
+			}
+
+			slot& it = slots_[index];
+			if (!it.used || it.generation != (uint32_t)(id >> 32)) {
+				return nullptr;
+			}
+			return &it;
+		}
+
+	private:
+		std::vector<slot> slots_;
+		std::vector<uint32_t> free_;
+		size_t size_;
+	};
+}
@@ -2,5 +2,18 @@
 #include "coroutine.hpp"
 #include "consts.hpp"
 #include "error.hpp"
+#include "buffer.hpp"
+#include "slotmap.hpp"
+#include "timer.hpp"
 #include "net.hpp"
+#include "udp.hpp"
+#include "connpool.hpp"
+#include "mpsc.hpp"
+#include "blocking.hpp"
+#include "histogram.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "admin.hpp"
+#include "http.hpp"
 #include "logging.hpp"
\ No newline at end of file
@@ -0,0 +1,199 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace st {
+	class TimingWheel;
+
+	// The node in the TimingWheel, embedded in the object to time out.
+	class TimerNode {
+	public:
+		TimerNode() = default;
+		TimerNode(const TimerNode&) = delete;
+		TimerNode& operator=(const TimerNode&) = delete;
+
+		virtual ~TimerNode() {
+			unlink();
+		}
+
+		// Whether the node is in a wheel.
+		bool pending() const { return prev_ != nullptr; }
+
+		// Called by TimingWheel::advance when the node expires, the node is already removed
+		// from the wheel, so it's safe to add it again.
+		virtual void on_timeout() = 0;
+
+	private:
+		friend class TimingWheel;
+
+		void unlink() {
+			if (prev_) {
+				prev_->next_ = next_;
+				next_->prev_ = prev_;
+				prev_ = next_ = nullptr;
+			}
+		}
+
+		void link_before(TimerNode* head) {
+			prev_ = head->prev_;
+			next_ = head;
+			head->prev_->next_ = this;
+			head->prev_ = this;
+		}
+
+		TimerNode* prev_ = nullptr;
+		TimerNode* next_ = nullptr;
+		// The tick to expire.
+		uint64_t expires_ = 0;
+	};
+
+	// The hierarchical timing wheel, the first level has 256 slots of one tick and each of
+	// the 3 upper levels has 64 slots of the whole lower level, like the Linux kernel timers.
+	// Add and cancel are O(1), each tick expires one slot of the first level, and every 256
+	// ticks a slot of the upper level is cascaded down, so the work per tick doesn't depend
+	// on the number of nodes.
+	// @remark The time is in microseconds, the same as utime_t.
+	class TimingWheel {
+	public:
+		// @param tick, the resolution of the wheel, the timeouts are rounded up to it.
+		// @param now, the current time.
+		TimingWheel(int64_t tick = 1000000, int64_t now = 0) {
+			for (int i = 0; i < LEVELS; i++) {
+				for (int j = 0; j < SLOTS[i]; j++) {
+					slots_[i][j].prev_ = slots_[i][j].next_ = &slots_[i][j];
+				}
+			}
+			reset(tick, now);
+		}
+
+		TimingWheel(const TimingWheel&) = delete;
+		TimingWheel& operator=(const TimingWheel&) = delete;
+
+		~TimingWheel() {
+			for (int i = 0; i < LEVELS; i++) {
+				for (int j = 0; j < SLOTS[i]; j++) {
+					while (slots_[i][j].next_ != &slots_[i][j]) {
+						slots_[i][j].next_->unlink();
+					}
+				}
+			}
+		}
+
+		// Set the tick and the time of the empty wheel.
+		void reset(int64_t tick, int64_t now) {
+			tick_ = tick > 0 ? tick : 1;
+			base_ = now;
+			jiffies_ = 0;
+		}
+
+		int64_t tick() const { return tick_; }
+
+		// The time of the current tick, which is updated by advance.
+		int64_t now() const { return base_ + (int64_t)jiffies_ * tick_; }
+
+		size_t size() const { return size_; }
+
+		// Expire the node after timeout, which is re-added if it's pending.
+		void add(TimerNode* node, int64_t timeout) {
+			cancel(node);
+			uint64_t ticks = timeout > 0 ? (uint64_t)((timeout + tick_ - 1) / tick_) : 1;
+			node->expires_ = jiffies_ + ticks;
+			place(node);
+			size_++;
+		}
+
+		void cancel(TimerNode* node) {
+			if (node->pending()) {
+				node->unlink();
+				size_--;
+			}
+		}
+
+		// Run the ticks until now, call on_timeout of the expired nodes.
+		void advance(int64_t now) {
+			uint64_t target = now > base_ ? (uint64_t)((now - base_) / tick_) : 0;
+			while (jiffies_ < target) {
+				jiffies_++;
+				int index = (int)(jiffies_ & (SLOTS[0] - 1));
+				// Cascade the upper levels when the lower level wraps.
+				for (int level = 1; level < LEVELS && index == 0; level++) {
+					index = cascade(level);
+				}
+
+				slot_head expired;
+				splice(&slots_[0][jiffies_ & (SLOTS[0] - 1)], &expired);
+
+				while (expired.next_ != &expired) {
+					TimerNode* node = expired.next_;
+					node->unlink();
+					size_--;
+					node->on_timeout();
+				}
+			}
+		}
+
+	private:
+		static const int LEVELS = 4;
+		static constexpr int SLOTS[LEVELS] = { 256, 64, 64, 64 };
+		// The bits of ticks covered by the lower levels.
+		static constexpr int SHIFT[LEVELS] = { 0, 8, 14, 20 };
+		static const uint64_t MAX_TICKS = (1ULL << 26) - 1;
+
+		// The sentinel of the slots.
+		struct slot_head :public TimerNode {
+			void on_timeout() override {}
+		};
+
+		void place(TimerNode* node) {
+			uint64_t delta = node->expires_ - jiffies_;
+			if (node->expires_ < jiffies_) {
+				delta = 0;
+				node->expires_ = jiffies_;
+			}
+			else if (delta > MAX_TICKS) {
+				delta = MAX_TICKS;
+				node->expires_ = jiffies_ + MAX_TICKS;
+			}
+
+			int level = 0;
+			while (level < LEVELS - 1 && delta >= (1ULL << SHIFT[level + 1])) {
+				level++;
+			}
+			int index = (int)((node->expires_ >> SHIFT[level]) & (SLOTS[level] - 1));
+			node->link_before(&slots_[level][index]);
+		}
+
+		// Move the nodes of the current slot of the level to the lower levels, return the index.
+		int cascade(int level) {
+			int index = (int)((jiffies_ >> SHIFT[level]) & (SLOTS[level] - 1));
+			slot_head pending;
+			splice(&slots_[level][index], &pending);
+			while (pending.next_ != &pending) {
+				TimerNode* node = pending.next_;
+				node->unlink();
+				place(node);
+			}
+			return index;
+		}
+
+		// Move all nodes of from to the empty list to.
+		static void splice(TimerNode* from, TimerNode* to) {
+			to->prev_ = to->next_ = to;
+			if (from->next_ == from) {
+				return;
+			}
+			to->next_ = from->next_;
+			to->prev_ = from->prev_;
+			to->next_->prev_ = to;
+			to->prev_->next_ = to;
+			from->prev_ = from->next_ = from;
+		}
+
+	private:
+		slot_head slots_[LEVELS][256];
+		int64_t tick_;
+		int64_t base_;
+		uint64_t jiffies_;
+		size_t size_ = 0;
+	};
+}
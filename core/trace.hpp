@@ -0,0 +1,244 @@
+#pragma once
+#include <st.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "coroutine.hpp"
+#include "consts.hpp"
+#include "error.hpp"
+
+// The default events kept by each thread, the oldest are overwritten.
+#define TRACE_RING_SIZE (64 * 1024)
+
+namespace st {
+	// A span, the name and the category are literals, which are not copied.
+	struct TraceEvent {
+		const char* name;
+		const char* cat;
+		const char* coroutine_name;
+		uint64_t coroutine;
+		// In nanoseconds of the steady clock.
+		int64_t ts;
+		int64_t dur;
+	};
+
+	// The spans of the coroutines, each thread writes its own ring, and all rings are
+	// exported to a Chrome trace or Perfetto JSON file, in which every coroutine is a track
+	// and the threads are the processes. When the switches are traced, each run slice of a
+	// coroutine is a span of the sched category, so the gaps are the time it waited.
+	// @remark Recording a span is a clock read and an uncontended lock, and a load when stopped.
+	class Tracer {
+	public:
+		static Tracer& instance() {
+			static Tracer* tracer = new Tracer();
+			return *tracer;
+		}
+
+		static bool enabled() {
+			return instance().enabled_.load(std::memory_order_relaxed);
+		}
+
+		static int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// Start tracing of all threads, the rings are created with the size.
+		// @param switches, whether trace the switches of the current ST thread.
+		void start(size_t ring_size = TRACE_RING_SIZE, bool switches = false) {
+			ring_size_ = ring_size > 0 ? ring_size : 1;
+			enabled_ = true;
+			if (switches) {
+				trace_switches(true);
+			}
+		}
+
+		void stop() {
+			enabled_ = false;
+			trace_switches(false);
+		}
+
+		// Trace the switches of the current ST thread, each ST thread enables its own.
+		void trace_switches(bool on) {
+			bool& installed = switches_installed();
+			if (on && !installed) {
+				__detail::switch_hooks::add(&Tracer::on_switch_in, &Tracer::on_switch_out);
+			}
+			else if (!on && installed) {
+				__detail::switch_hooks::remove(&Tracer::on_switch_in, &Tracer::on_switch_out);
+			}
+			installed = on;
+		}
+
+		void record(const char* name, const char* cat, int64_t ts, int64_t dur) {
+			ring* r = local();
+			std::lock_guard<std::mutex> lock(r->mutex);
+			TraceEvent& e = r->events[r->next % r->events.size()];
+			e.name = name;
+			e.cat = cat;
+			e.coroutine_name = this_coroutine::name();
+			e.coroutine = (uint64_t)(uintptr_t)st_thread_self();
+			e.ts = ts;
+			e.dur = dur;
+			r->next++;
+		}
+
+		// Drop the events of all threads.
+		void clear() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (auto& r : rings_) {
+				std::lock_guard<std::mutex> rlock(r->mutex);
+				r->next = 0;
+			}
+		}
+
+		// Write the events of all threads to the file in the Chrome trace event format.
+		error_t write(const char* path) {
+			FILE* f = fopen(path, "w");
+			if (!f) {
+				return error_new(ERROR_SYSTEM_FILE_OPENE, "open %s", path);
+			}
+
+			fprintf(f, "{\"traceEvents\":[\n");
+			bool first = true;
+			std::vector<std::shared_ptr<ring>> rings;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				rings = rings_;
+			}
+
+			for (size_t pid = 0; pid < rings.size(); pid++) {
+				std::vector<TraceEvent> events;
+				{
+					std::lock_guard<std::mutex> lock(rings[pid]->mutex);
+					ring& r = *rings[pid];
+					uint64_t n = std::min<uint64_t>(r.next, r.events.size());
+					for (uint64_t i = r.next - n; i < r.next; i++) {
+						events.push_back(r.events[i % r.events.size()]);
+					}
+				}
+
+				// The coroutines are the tracks, named by their names.
+				std::unordered_map<uint64_t, int> tids;
+				for (auto& e : events) {
+					auto it = tids.find(e.coroutine);
+					if (it == tids.end()) {
+						int tid = (int)tids.size() + 1;
+						tids[e.coroutine] = tid;
+						char name[64];
+						snprintf(name, sizeof(name), "coroutine-%lx", (unsigned long)e.coroutine);
+						fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+							first ? "" : ",\n", (int)pid + 1, tid, escape(e.coroutine_name ? e.coroutine_name : name).c_str());
+						first = false;
+					}
+					fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+						escape(e.name).c_str(), escape(e.cat).c_str(), e.ts / 1000.0, e.dur / 1000.0, (int)pid + 1, tids[e.coroutine]);
+				}
+			}
+			fprintf(f, "\n]}\n");
+
+			if (fclose(f) != 0) {
+				return error_new(ERROR_SYSTEM_FILE_WRITE, "write %s", path);
+			}
+			return error_ok;
+		}
+
+	private:
+		Tracer() = default;
+
+		struct ring {
+			std::mutex mutex;
+			std::vector<TraceEvent> events;
+			uint64_t next = 0;
+		};
+
+		// The ring of the current thread, which is kept after the thread quits to export.
+		ring* local() {
+			static thread_local ring* r = nullptr;
+			if (!r) {
+				std::shared_ptr<ring> p = std::make_shared<ring>();
+				p->events.resize(ring_size_);
+				std::lock_guard<std::mutex> lock(mutex_);
+				rings_.push_back(p);
+				r = p.get();
+			}
+			return r;
+		}
+
+		static bool& switches_installed() {
+			static thread_local bool installed = false;
+			return installed;
+		}
+
+		static int64_t& slice_start() {
+			static thread_local int64_t start = 0;
+			return start;
+		}
+
+		static void on_switch_in() {
+			slice_start() = now();
+		}
+
+		static void on_switch_out() {
+			int64_t start = slice_start();
+			if (start && enabled()) {
+				instance().record("run", "sched", start, now() - start);
+			}
+			slice_start() = 0;
+		}
+
+		static std::string escape(const char* s) {
+			std::string v;
+			for (; *s; s++) {
+				if (*s == '"' || *s == '\\') {
+					v += '\\';
+				}
+				v += *s;
+			}
+			return v;
+		}
+
+	private:
+		std::atomic<bool> enabled_{ false };
+		size_t ring_size_ = TRACE_RING_SIZE;
+		std::mutex mutex_;
+		std::vector<std::shared_ptr<ring>> rings_;
+	};
+
+	// Record the span from the construction to the destruction, when the tracer is started.
+	class TraceSpan {
+	public:
+		explicit TraceSpan(const char* name, const char* cat = "app") :name_(name), cat_(cat) {
+			start_ = Tracer::enabled() ? Tracer::now() : 0;
+		}
+
+		~TraceSpan() {
+			if (start_) {
+				Tracer::instance().record(name_, cat_, start_, Tracer::now() - start_);
+			}
+		}
+
+		TraceSpan(const TraceSpan&) = delete;
+		TraceSpan& operator=(const TraceSpan&) = delete;
+
+	private:
+		const char* name_;
+		const char* cat_;
+		int64_t start_;
+	};
+}
+
+// Trace the scope, for example ST_TRACE_SPAN("handler"), define ST_DISABLE_TRACE to
+// remove the spans at compile time.
+#ifndef ST_DISABLE_TRACE
+#define __ST_TRACE_CONCAT2(a, b) a##b
+#define __ST_TRACE_CONCAT(a, b) __ST_TRACE_CONCAT2(a, b)
+#define ST_TRACE_SPAN(name, ...) st::TraceSpan __ST_TRACE_CONCAT(__st_trace_span_, __COUNTER__)(name, ##__VA_ARGS__)
+#else
+#define ST_TRACE_SPAN(name, ...)
+#endif
@@ -0,0 +1,799 @@
+#pragma once
+#include <st.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include "net.hpp"
+
+// The max datagrams received or sent by one syscall.
+#define UDP_MAX_BATCH 64
+// The bytes of each receive buffer, enough for a datagram in the ethernet MTU.
+#define UDP_PACKET_SIZE 1500
+// The bytes of each receive buffer when GRO is on, which holds a coalesced datagram.
+#define UDP_GRO_PACKET_SIZE 65536
+// The max bytes of a datagram, and the max segments of a GSO send.
+#define UDP_MAX_PAYLOAD 65507
+#define UDP_MAX_GSO_SEGMENTS 64
+// The max datagrams queued for a session, the new ones are dropped when full.
+#define UDP_SESSION_QUEUE_SIZE 128
+// The default timeout of the idle sessions, UDP has no close so a session ends by idle.
+#define UDP_SESSION_IDLE_TIMEOUT (30 * UTIME_SECONDS)
+
+namespace st {
+	// A datagram, which references the buffers of the UdpSocket or the caller.
+	struct UdpPacket {
+		const sockaddr* addr;
+		socklen_t addrlen;
+		char* data;
+		size_t size;
+	};
+
+	// The UDP socket to receive and send the datagrams in batches by recvmmsg and sendmmsg,
+	// waits in the ST scheduler by st_netfd_poll when the socket would block.
+	class UdpSocket {
+	public:
+		// @param batch, the max datagrams received each time.
+		// @param packet_size, the bytes of each receive buffer.
+		UdpSocket(int batch = UDP_MAX_BATCH, size_t packet_size = UDP_PACKET_SIZE) {
+			stfd_ = NULL;
+			batch_ = batch > 0 ? batch : 1;
+			packet_size_ = packet_size;
+			rtm_ = stm_ = UTIME_NO_TIMEOUT;
+			rbytes_ = sbytes_ = 0;
+			truncated_ = 0;
+			gro_ = false;
+			gso_ = true;
+			alloc();
+		}
+
+		virtual ~UdpSocket() {
+			close();
+		}
+
+		UdpSocket(const UdpSocket&) = delete;
+		UdpSocket& operator=(const UdpSocket&) = delete;
+
+	public:
+		// Initialize with a bound or connected UDP stfd, the socket takes it.
+		error_t initialize(netfd_t fd) { stfd_ = fd; return error_ok; }
+
+		error_t listen(const std::string& ip, int port) {
+			error_t err;
+			if ((err = __detail::udp_listen(ip, port, &stfd_)) != error_ok) {
+				return error_trace(err);
+			}
+			return err;
+		}
+
+		netfd_t get_netfd() { return stfd_; }
+
+		// Close the socket, no coroutine may wait on it.
+		void close() {
+			__detail::close_stfd(stfd_);
+		}
+
+		void set_recv_timeout(utime_t tm) { rtm_ = tm; }
+		void set_send_timeout(utime_t tm) { stm_ = tm; }
+		int64_t get_recv_bytes() { return rbytes_; }
+		int64_t get_send_bytes() { return sbytes_; }
+		// The datagrams dropped because they are larger than the receive buffer.
+		int64_t get_truncated() { return truncated_; }
+
+		// Let the kernel coalesce the datagrams of a flow into one buffer, which recv
+		// splits back to the datagrams, return false if the kernel doesn't support it.
+		// @remark The receive buffers grow to UDP_GRO_PACKET_SIZE.
+		bool enable_gro() {
+#ifdef UDP_GRO
+			int v = 1;
+			if (setsockopt(st_netfd_fileno(stfd_), SOL_UDP, UDP_GRO, &v, sizeof(v)) == -1) {
+				return false;
+			}
+
+			gro_ = true;
+			if (packet_size_ < UDP_GRO_PACKET_SIZE) {
+				packet_size_ = UDP_GRO_PACKET_SIZE;
+				alloc();
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+	public:
+		// Receive a batch of datagrams, wait until at least one arrives.
+		// @param pkts, set to the datagrams, which are valid until the next recv.
+		error_t recv(UdpPacket** pkts, int* npkts) {
+			error_t err;
+			// The datagrams of a batch may be all dropped.
+			do {
+				if ((err = recv_batch()) != error_ok) {
+					return error_trace(err);
+				}
+			} while (pkts_.empty());
+
+			*pkts = pkts_.data();
+			*npkts = (int)pkts_.size();
+			return err;
+		}
+
+		// Send the datagrams by sendmmsg, wait when the socket buffer is full.
+		// @remark The headers are on the stack of the caller, so the coroutines which share
+		//		the socket can send while another one waits for it to be writable.
+		error_t send(const UdpPacket* pkts, int npkts) {
+			error_t err;
+			mmsghdr msgs[UDP_MAX_BATCH];
+			iovec iovs[UDP_MAX_BATCH];
+			while (npkts > 0) {
+				int n = std::min(npkts, UDP_MAX_BATCH);
+				for (int i = 0; i < n; i++) {
+					iovs[i].iov_base = pkts[i].data;
+					iovs[i].iov_len = pkts[i].size;
+					msghdr& hdr = msgs[i].msg_hdr;
+					memset(&hdr, 0, sizeof(hdr));
+					hdr.msg_name = (void*)pkts[i].addr;
+					hdr.msg_namelen = pkts[i].addrlen;
+					hdr.msg_iov = &iovs[i];
+					hdr.msg_iovlen = 1;
+				}
+
+				int sent = 0;
+				while (sent < n) {
+					int r = ::sendmmsg(st_netfd_fileno(stfd_), msgs + sent, n - sent, MSG_DONTWAIT);
+					if (r > 0) {
+						for (int i = sent; i < sent + r; i++) {
+							sbytes_ += msgs[i].msg_len;
+						}
+						sent += r;
+						continue;
+					}
+
+					if ((err = wait_writable(r, "sendmmsg")) != error_ok) {
+						return error_trace(err);
+					}
+				}
+
+				pkts += n;
+				npkts -= n;
+			}
+			return err;
+		}
+
+		// Send data to addr as the datagrams of segment bytes, the last one may be shorter.
+		// Use one syscall for up to UDP_MAX_GSO_SEGMENTS datagrams by GSO, or sendmmsg when
+		// the kernel doesn't support it.
+		error_t send_gso(const sockaddr* addr, socklen_t addrlen, char* data, size_t size, size_t segment) {
+			error_t err;
+			if (segment == 0 || segment > UDP_MAX_PAYLOAD) {
+				return error_new(ERROR_SYSTEM_PACKET_INVALID, "invalid segment %d", (int)segment);
+			}
+
+#ifdef UDP_SEGMENT
+			size_t max = std::min((size_t)UDP_MAX_GSO_SEGMENTS, UDP_MAX_PAYLOAD / segment) * segment;
+			while (gso_ && size > segment) {
+				size_t n = std::min(size, max);
+				ssize_t r = send_segments(addr, addrlen, data, n, (uint16_t)segment);
+				if (r > 0) {
+					sbytes_ += r;
+					data += n;
+					size -= n;
+					continue;
+				}
+
+				// The kernel or the device doesn't support GSO.
+				if (r == -1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+					gso_ = false;
+					break;
+				}
+
+				if ((err = wait_writable((int)r, "sendmsg gso")) != error_ok) {
+					return error_trace(err);
+				}
+			}
+#endif
+
+			std::vector<UdpPacket> pkts;
+			for (size_t off = 0; off < size; off += segment) {
+				pkts.push_back(UdpPacket{ addr, addrlen, data + off, std::min(segment, size - off) });
+			}
+			if ((err = send(pkts.data(), (int)pkts.size())) != error_ok) {
+				return error_trace(err);
+			}
+			return err;
+		}
+
+	private:
+		static const int CONTROL_SIZE = 64;
+
+		// Receive a batch of datagrams to pkts_, drop the truncated ones.
+		error_t recv_batch() {
+			for (int i = 0; i < batch_; i++) {
+				iovs_[i].iov_base = bufs_.data() + i * packet_size_;
+				iovs_[i].iov_len = packet_size_;
+				msghdr& hdr = msgs_[i].msg_hdr;
+				memset(&hdr, 0, sizeof(hdr));
+				hdr.msg_name = &addrs_[i];
+				hdr.msg_namelen = sizeof(sockaddr_storage);
+				hdr.msg_iov = &iovs_[i];
+				hdr.msg_iovlen = 1;
+				if (gro_) {
+					hdr.msg_control = ctrls_.data() + i * CONTROL_SIZE;
+					hdr.msg_controllen = CONTROL_SIZE;
+				}
+			}
+
+			int n;
+			while ((n = ::recvmmsg(st_netfd_fileno(stfd_), msgs_.data(), batch_, MSG_DONTWAIT, NULL)) <= 0) {
+				if (n == -1 && errno == EINTR) {
+					continue;
+				}
+
+				if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					if (st_netfd_poll(stfd_, POLLIN, rtm_) == -1) {
+						if (errno == ETIME) {
+							return error_new(ERROR_SOCKET_TIMEOUT, "recvmmsg timeout %d ms", u2msi(rtm_));
+						}
+						return error_new(ERROR_SOCKET_WAIT, "recvmmsg wait");
+					}
+					continue;
+				}
+
+				return error_new(ERROR_SOCKET_READ, "recvmmsg");
+			}
+
+			pkts_.clear();
+			for (int i = 0; i < n; i++) {
+				msghdr& hdr = msgs_[i].msg_hdr;
+				char* data = (char*)iovs_[i].iov_base;
+				size_t size = msgs_[i].msg_len;
+				size_t segment = gro_segment(hdr);
+				rbytes_ += size;
+
+				// Larger than the buffer, drop it instead of passing it cut.
+				if (hdr.msg_flags & MSG_TRUNC) {
+					truncated_++;
+					LOG(WARNNING) << "UDP datagram truncated by buffer " << packet_size_ << ", dropped " << truncated_;
+					continue;
+				}
+
+				// A coalesced datagram is split to the datagrams of the segment size,
+				// and the last one may be shorter.
+				for (size_t off = 0; off < size || off == 0; off += segment) {
+					size_t len = std::min(segment, size - off);
+					pkts_.push_back(UdpPacket{ (const sockaddr*)&addrs_[i], hdr.msg_namelen, data + off, len });
+					if (len == 0) {
+						break;
+					}
+				}
+			}
+
+			return error_ok;
+		}
+
+		void alloc() {
+			bufs_.resize(batch_ * packet_size_);
+			iovs_.resize(batch_);
+			msgs_.resize(batch_);
+			addrs_.resize(batch_);
+			ctrls_.resize(batch_ * CONTROL_SIZE);
+		}
+
+		// The segment size of a GRO datagram, or the whole datagram.
+		size_t gro_segment(msghdr& hdr) {
+			size_t size = packet_size_;
+#ifdef UDP_GRO
+			if (gro_) {
+				for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+					if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+						int v = 0;
+						memcpy(&v, CMSG_DATA(cmsg), sizeof(v));
+						if (v > 0) {
+							size = v;
+						}
+					}
+				}
+			}
+#endif
+			return size;
+		}
+
+#ifdef UDP_SEGMENT
+		ssize_t send_segments(const sockaddr* addr, socklen_t addrlen, char* data, size_t size, uint16_t segment) {
+			iovec iov = { data, size };
+			char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+			memset(ctrl, 0, sizeof(ctrl));
+
+			msghdr hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = (void*)addr;
+			hdr.msg_namelen = addrlen;
+			hdr.msg_iov = &iov;
+			hdr.msg_iovlen = 1;
+			hdr.msg_control = ctrl;
+			hdr.msg_controllen = sizeof(ctrl);
+
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+
+			return ::sendmsg(st_netfd_fileno(stfd_), &hdr, MSG_DONTWAIT);
+		}
+#endif
+
+		// Wait for the socket to be writable when the send would block.
+		error_t wait_writable(int r, const char* op) {
+			if (r == -1 && errno == EINTR) {
+				return error_ok;
+			}
+
+			if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+				if (st_netfd_poll(stfd_, POLLOUT, stm_) == -1) {
+					if (errno == ETIME) {
+						return error_new(ERROR_SOCKET_TIMEOUT, "%s timeout %d ms", op, u2msi(stm_));
+					}
+					return error_new(ERROR_SOCKET_WAIT, "%s wait", op);
+				}
+				return error_ok;
+			}
+
+			return error_new(ERROR_SOCKET_WRITE, "%s", op);
+		}
+
+	private:
+		netfd_t stfd_;
+		int batch_;
+		size_t packet_size_;
+		utime_t rtm_;
+		utime_t stm_;
+		int64_t rbytes_;
+		int64_t sbytes_;
+		int64_t truncated_;
+		bool gro_;
+		bool gso_;
+		// The receive buffers and headers, preallocated for the batch.
+		std::vector<char> bufs_;
+		std::vector<iovec> iovs_;
+		std::vector<mmsghdr> msgs_;
+		std::vector<sockaddr_storage> addrs_;
+		std::vector<char> ctrls_;
+		std::vector<UdpPacket> pkts_;
+	};
+
+	using UdpHandler = std::function<void(UdpSocket& sock, UdpPacket* pkts, int npkts)>;
+
+	// The UDP server, receives the datagrams in batches in one coroutine and passes each
+	// batch to the handler.
+	class UdpServer {
+	public:
+		UdpServer(const char* host, int port, int batch = UDP_MAX_BATCH, size_t packet_size = UDP_PACKET_SIZE)
+			:host_(host), port_(port), sock_(batch, packet_size) {}
+
+		~UdpServer() {
+			stop();
+		}
+
+		UdpServer(const UdpServer&) = delete;
+		UdpServer& operator=(const UdpServer&) = delete;
+
+		// The handler runs in the receive coroutine, the packets are valid in the handler.
+		void onDatagrams(UdpHandler handler) {
+			handler_ = std::move(handler);
+		}
+
+		// Try to enable GRO when start, must be called before start.
+		void set_gro(bool on) { gro_ = on; }
+
+		error_t start() {
+			error_t err;
+			if ((err = sock_.listen(host_, port_)) != error_ok) {
+				return error_trace(err);
+			}
+
+			if (gro_ && !sock_.enable_gro()) {
+				LOG(WARNNING) << "UDP GRO not supported, port=" << port_;
+			}
+
+			exit_ = false;
+			started_ = true;
+			co_ = st::coroutine(1, &UdpServer::run, this);
+			return error_ok;
+		}
+
+		// Stop receiving, wait for the receive coroutine to quit and close the socket.
+		// @remark Must be called in the ST thread of the server, but not by its coroutines.
+		void stop() {
+			if (!started_) {
+				return;
+			}
+			started_ = false;
+			exit_ = true;
+			co_.terminate();
+			{
+				st::coroutine recv(std::move(co_));
+			}
+			sock_.close();
+		}
+
+		// The socket to send the responses.
+		UdpSocket& socket() { return sock_; }
+
+	private:
+		void run() {
+			while (!exit_) {
+				UdpPacket* pkts = nullptr;
+				int npkts = 0;
+				error_t err = sock_.recv(&pkts, &npkts);
+				if (err) {
+					if (exit_) {
+						break;
+					}
+					LOG(WARNNING) << err->what();
+					st_usleep(10 * UTIME_MILLISECONDS);
+					continue;
+				}
+
+				if (handler_) {
+					handler_(sock_, pkts, npkts);
+				}
+			}
+		}
+
+	private:
+		std::string host_;
+		int port_;
+		UdpSocket sock_;
+		st::coroutine co_;
+		bool exit_ = false;
+		bool started_ = false;
+		bool gro_ = false;
+		UdpHandler handler_;
+	};
+
+	namespace __detail {
+		// The key of a peer, the family, port and ip of the address.
+		struct peer_key {
+			unsigned char data[20];
+
+			bool operator==(const peer_key& o) const {
+				return memcmp(data, o.data, sizeof(data)) == 0;
+			}
+		};
+
+		struct peer_key_hash {
+			size_t operator()(const peer_key& k) const {
+				// FNV-1a
+				uint64_t h = 14695981039346656037ULL;
+				for (size_t i = 0; i < sizeof(k.data); i++) {
+					h = (h ^ k.data[i]) * 1099511628211ULL;
+				}
+				return (size_t)h;
+			}
+		};
+
+		inline peer_key make_peer_key(const sockaddr* addr) {
+			peer_key k;
+			memset(&k, 0, sizeof(k));
+			memcpy(k.data, &addr->sa_family, 2);
+			if (addr->sa_family == AF_INET) {
+				const sockaddr_in* in = (const sockaddr_in*)addr;
+				memcpy(k.data + 2, &in->sin_port, 2);
+				memcpy(k.data + 4, &in->sin_addr, 4);
+			}
+			else if (addr->sa_family == AF_INET6) {
+				const sockaddr_in6* in6 = (const sockaddr_in6*)addr;
+				memcpy(k.data + 2, &in6->sin6_port, 2);
+				memcpy(k.data + 4, &in6->sin6_addr, 16);
+			}
+			return k;
+		}
+	}
+
+	class UdpSessionServer;
+	template<typename Server>
+	class UdpSession;
+	using UdpSessionPtr = std::shared_ptr<UdpSession<UdpSessionServer>>;
+	using UdpSessionHandler = std::function<void(UdpSessionPtr session)>;
+
+	// The session of a peer on the UdpSessionServer, the datagrams from the peer are
+	// copied to a bounded queue and read by the handler coroutine of the session.
+	template<typename Server>
+	class UdpSession :public std::enable_shared_from_this<UdpSession<Server>>, public TimerNode {
+	public:
+		friend Server;
+		UdpSession(Server* svr, const sockaddr* addr, socklen_t addrlen, int queue_size)
+			:svr_(svr), queue_(queue_size > 0 ? queue_size : 1) {
+			memset(&addr_, 0, sizeof(addr_));
+			memcpy(&addr_, addr, std::min((size_t)addrlen, sizeof(addr_)));
+			addrlen_ = addrlen;
+		}
+
+		uint64_t id() const { return id_; }
+		const sockaddr* peer() const { return (const sockaddr*)&addr_; }
+		socklen_t peer_len() const { return addrlen_; }
+
+		// The datagrams in the queue, and the ones dropped because the queue is full.
+		int queued() const { return count_; }
+		int64_t dropped() const { return dropped_; }
+
+		// Wait for the next datagram of the peer. The data is swapped with the queued one,
+		// so passing the same string each time reuses the memory.
+		error_t recv(std::string& data, utime_t timeout = UTIME_NO_TIMEOUT) {
+			while (count_ == 0) {
+				if (closed_) {
+					return error_new(ERROR_SOCKET_CLOSED, "session %d closed", (int)(id_ & 0xFFFFFFFF));
+				}
+
+				if (st_cond_timedwait(cond_.native_handle(), timeout) == -1) {
+					if (errno == ETIME) {
+						return error_new(ERROR_SOCKET_TIMEOUT, "session recv timeout %d ms", u2msi(timeout));
+					}
+					return error_new(ERROR_THREAD_INTERRUPED, "session recv interrupted");
+				}
+			}
+
+			data.swap(queue_[head_]);
+			head_ = (head_ + 1) % (int)queue_.size();
+			count_--;
+			return error_ok;
+		}
+
+		// Send a datagram to the peer by the socket of the server.
+		error_t send(const void* data, size_t size) {
+			error_t err;
+			UdpPacket pkt = { peer(), addrlen_, (char*)data, size };
+			if ((err = svr_->socket().send(&pkt, 1)) != error_ok) {
+				return error_trace(err);
+			}
+			last_active_ = svr_->wheel_.now();
+			return err;
+		}
+
+		// Interrupt the handler when the peer is idle, like TcpConnection::on_timeout.
+		virtual void on_timeout() override {
+			utime_t idle = svr_->wheel_.now() - last_active_;
+			if (idle < svr_->idle_timeout_) {
+				svr_->wheel_.add(this, svr_->idle_timeout_ - idle);
+				return;
+			}
+
+			LOG(TRACE) << "session " << id_ << " idle " << u2ms(idle) << "ms, interrupt it";
+			closed_ = true;
+			co_.terminate();
+		}
+
+	private:
+		// Copy the datagram to the queue, return false if it's full.
+		bool push(const char* data, size_t size) {
+			if (closed_ || count_ == (int)queue_.size()) {
+				dropped_++;
+				return false;
+			}
+
+			queue_[(head_ + count_) % (int)queue_.size()].assign(data, size);
+			count_++;
+			last_active_ = svr_->wheel_.now();
+			cond_.notify_one();
+			return true;
+		}
+
+		void start(UdpSessionHandler handler) {
+			coroutine::attributes attr;
+			attr.stack_size = svr_->stack_size_;
+			co_ = st::coroutine(attr,
+				[this](UdpSessionHandler handler)
+				{
+					handler(this->shared_from_this());
+					closed_ = true;
+					svr_->removeSession(id_);
+				},
+				handler);
+		}
+
+	private:
+		Server* svr_;
+		st::coroutine co_;
+		sockaddr_storage addr_;
+		socklen_t addrlen_;
+		// The ring of the queued datagrams, the strings are reused.
+		std::vector<std::string> queue_;
+		int head_ = 0;
+		int count_ = 0;
+		st::condition_variable cond_;
+		bool closed_ = false;
+		int64_t dropped_ = 0;
+		uint64_t id_ = 0;
+		// The time of the last datagram received or sent, by the clock of the timing wheel.
+		utime_t last_active_ = 0;
+	};
+
+	// The UDP server with connection-like sessions over one socket. The datagrams are
+	// demultiplexed by the source address to the sessions, each has a coroutine running
+	// the handler, which is created by the first datagram of the peer, and ends when
+	// the handler returns or the peer is idle for the timeout.
+	class UdpSessionServer {
+	public:
+		friend UdpSession<UdpSessionServer>;
+		UdpSessionServer(const char* host, int port, int batch = UDP_MAX_BATCH, size_t packet_size = UDP_PACKET_SIZE)
+			:udp_(host, port, batch, packet_size) {}
+
+		~UdpSessionServer() {
+			stop();
+		}
+
+		UdpSessionServer(const UdpSessionServer&) = delete;
+		UdpSessionServer& operator=(const UdpSessionServer&) = delete;
+
+		void onNewSession(UdpSessionHandler handler) {
+			handler_ = std::move(handler);
+		}
+
+		// The stack size of the session coroutines, 0 for the default.
+		void set_coroutine_stack_size(int size) { stack_size_ = size; }
+
+		// The max sessions, the datagrams of new peers are dropped once reached, 0 for no limit.
+		void set_max_sessions(int max) { max_sessions_ = max; }
+
+		// The max datagrams queued for each session, must be called before start.
+		void set_queue_size(int size) { queue_size_ = size; }
+
+		// The timeout of the idle sessions, checked by a timing wheel of the tick, 0 to
+		// keep the sessions until the handlers return. Must be called before start.
+		void set_idle_timeout(utime_t timeout, utime_t tick = SERVER_IDLE_TICK) {
+			idle_timeout_ = timeout;
+			idle_tick_ = tick;
+		}
+
+		void set_gro(bool on) { udp_.set_gro(on); }
+
+		error_t start() {
+			error_t err;
+			udp_.onDatagrams([this](UdpSocket&, UdpPacket* pkts, int npkts) {
+				dispatch(pkts, npkts);
+				});
+			if ((err = udp_.start()) != error_ok) {
+				return error_trace(err);
+			}
+			exit_ = false;
+			started_ = true;
+
+			if (idle_timeout_ > 0) {
+				wheel_.reset(idle_tick_, (utime_t)st_utime());
+				idleco_ = st::coroutine(1, &UdpSessionServer::check_idle, this);
+			}
+			return err;
+		}
+
+		// Drop the new datagrams, interrupt the handlers of the sessions and wait for them
+		// to return, then stop receiving and close the socket.
+		// @remark Must be called in the ST thread of the server, but not by its coroutines,
+		//		and blocks as long as a handler ignores the interrupt.
+		void stop() {
+			if (!started_) {
+				return;
+			}
+			started_ = false;
+			exit_ = true;
+			idleco_.terminate();
+			{
+				st::coroutine idle(std::move(idleco_));
+			}
+
+			std::vector<UdpSessionPtr> sessions;
+			sessions_.for_each([&](uint64_t, UdpSessionPtr& s) { sessions.push_back(s); });
+			for (auto& s : sessions) {
+				s->closed_ = true;
+				s->co_.terminate();
+			}
+			sessions.clear();
+
+			while (sessions_.size() > 0) {
+				drained_.wait();
+			}
+			udp_.stop();
+		}
+
+		size_t sessions() const { return sessions_.size(); }
+
+		// Find the session by id, nullptr if it's ended.
+		UdpSessionPtr session(uint64_t id) {
+			UdpSessionPtr* s = sessions_.get(id);
+			return s ? *s : nullptr;
+		}
+
+		// The datagrams dropped because the queue is full or the sessions reach the max.
+		int64_t dropped() const { return dropped_; }
+
+		UdpSocket& socket() { return udp_.socket(); }
+
+	private:
+		void dispatch(UdpPacket* pkts, int npkts) {
+			if (exit_) {
+				return;
+			}
+
+			for (int i = 0; i < npkts; i++) {
+				UdpPacket& pkt = pkts[i];
+				__detail::peer_key key = __detail::make_peer_key(pkt.addr);
+
+				UdpSessionPtr* s = nullptr;
+				auto it = peers_.find(key);
+				if (it != peers_.end()) {
+					s = sessions_.get(it->second);
+				}
+
+				if (!s) {
+					if (max_sessions_ > 0 && (int)sessions_.size() >= max_sessions_) {
+						dropped_++;
+						continue;
+					}
+					s = addSession(key, pkt);
+				}
+
+				if (!(*s)->push(pkt.data, pkt.size)) {
+					dropped_++;
+				}
+			}
+		}
+
+		UdpSessionPtr* addSession(const __detail::peer_key& key, const UdpPacket& pkt) {
+			UdpSessionPtr session(new UdpSession<UdpSessionServer>(this, pkt.addr, pkt.addrlen, queue_size_));
+			session->id_ = sessions_.insert(session);
+			session->last_active_ = wheel_.now();
+			peers_[key] = session->id_;
+			if (idle_timeout_ > 0) {
+				wheel_.add(session.get(), idle_timeout_);
+			}
+			session->start(handler_);
+			return sessions_.get(session->id_);
+		}
+
+		void removeSession(uint64_t id) {
+			UdpSessionPtr* s = sessions_.get(id);
+			if (!s) {
+				return;
+			}
+
+			wheel_.cancel(s->get());
+			auto it = peers_.find(__detail::make_peer_key((*s)->peer()));
+			if (it != peers_.end() && it->second == id) {
+				peers_.erase(it);
+			}
+			sessions_.erase(id);
+			if (exit_ && sessions_.size() == 0) {
+				drained_.notify_all();
+			}
+		}
+
+		void check_idle() {
+			while (!exit_) {
+				st_usleep(idle_tick_);
+				wheel_.advance((utime_t)st_utime());
+			}
+		}
+
+	private:
+		UdpServer udp_;
+		st::coroutine idleco_;
+		bool exit_ = false;
+		bool started_ = false;
+		// Signaled when the last session is removed after stop.
+		st::condition_variable drained_;
+		UdpSessionHandler handler_;
+		int stack_size_ = 0;
+		int max_sessions_ = 0;
+		int queue_size_ = UDP_SESSION_QUEUE_SIZE;
+		int64_t dropped_ = 0;
+		SlotMap<UdpSessionPtr> sessions_;
+		std::unordered_map<__detail::peer_key, uint64_t, __detail::peer_key_hash> peers_;
+		utime_t idle_timeout_ = UDP_SESSION_IDLE_TIMEOUT;
+		utime_t idle_tick_ = SERVER_IDLE_TICK;
+		TimingWheel wheel_;
+	};
+}
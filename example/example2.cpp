@@ -1,9 +1,6 @@
 #include <signal.h>
 #include <vector>
-#include <ostream>
-#include <sstream>
 #include <iostream>
-#include <signal.h>
 #include "core/stpp.h"
 
 st::condition_variable  stopcon;
@@ -12,23 +9,6 @@ void sig_handler(int signo) {
 	stopcon.notify_all();
 }
 
-class MyCodec :public st::IProtoCodec {
-public:
-	virtual st::error_t encode(unsigned char* data, size_t len, st::CodecCallback cbk) override {
-		std::vector<unsigned char> out(data, data + len);
-		cbk(std::move(out));
-		//LOG(INFO) << "encoded";
-		return error_ok;
-	}
-
-	virtual st::error_t decode(unsigned char* data, size_t len, st::CodecCallback cbk) override {
-		std::vector<unsigned char> out(data, data + len);
-		cbk(std::move(out));
-		//LOG(INFO) << "decode";
-		return error_ok;
-	}
-};
-
 int main() {
 	signal(SIGINT, sig_handler);
 	st::enable_coroutine();
@@ -42,19 +22,37 @@ int main() {
 	}
 	LOG(INFO) << "server listen on: " << port;
 
-	svr.onNewConnection(new MyCodec(), [](st::TcpConnectionPtr conn) {
+	st::HttpCodec codec;
+	svr.onNewConnection(&codec, [](st::TcpConnectionPtr conn) {
 		LOG(INFO) << "accept new client...";
-		std::vector<unsigned char> recvbuf;
-		conn->read(recvbuf);
-		auto tt = st::GetCurrentTimeStamp();
-		LOG(INFO) << tt;
-		std::stringstream ss;
-		ss << "HTTP/1.1 200 OK" << "\r\n";
-		ss << "Content-Type: text/plain" << "\r\n";
-		ss << "Content-Length: " << tt.size() << "\r\n";
-		ss << "\r\n";
-		ss << tt;
-		conn->write((void*)ss.str().data(), ss.str().size());
+		// The responses of the pipelined requests are written by one writev.
+		conn->set_cork(true);
+		bool keep_alive = true;
+		while (keep_alive) {
+			st::error_t err = conn->read([&](std::string_view msg) {
+				// The requests after the connection is to close are ignored.
+				if (!keep_alive) {
+					return;
+				}
+				st::HttpRequest req;
+				if (req.parse(msg) != error_ok) {
+					keep_alive = false;
+					return;
+				}
+				keep_alive = keep_alive && req.keep_alive();
+
+				auto tt = st::GetCurrentTimeStamp();
+				st::HttpResponse resp(200);
+				resp.add_header("Content-Type", "text/plain");
+				resp.set_keep_alive(keep_alive);
+				resp.set_body(tt);
+				resp.write(conn);
+				});
+			if (err) {
+				LOG(TRACE) << err->what();
+				break;
+			}
+		}
 		});
 
 	stopcon.wait();
@@ -0,0 +1,50 @@
+#include <signal.h>
+#include <vector>
+#include <ostream>
+#include <sstream>
+#include <iostream>
+#include "core/stpp.h"
+
+st::condition_variable  stopcon;
+
+void sig_handler(int signo) {
+	stopcon.notify_all();
+}
+
+// The example2 server, but with one scheduler per cpu core.
+int main(int argc, char** argv) {
+	signal(SIGINT, sig_handler);
+	st::enable_coroutine();
+	int port = 33333;
+	int workers = argc > 1 ? atoi(argv[1]) : 0;
+	st::TcpServerGroup svr("0.0.0.0", port, workers);
+	svr.set_cpu_affinity(true);
+	svr.onWorkerInit([](int index, st::TcpServer& worker) {
+		worker.set_coroutine_stack_size(64 * 1024);
+		st::coroutine::reserve_stacks(256, 64 * 1024);
+		});
+	svr.onNewConnection(new st::RawCodec(), [](st::TcpConnectionPtr conn) {
+		conn->read([](std::string_view req) {});
+		auto tt = st::GetCurrentTimeStamp();
+		std::stringstream ss;
+		ss << "HTTP/1.1 200 OK" << "\r\n";
+		ss << "Content-Type: text/plain" << "\r\n";
+		ss << "Content-Length: " << tt.size() << "\r\n";
+		ss << "\r\n";
+		ss << tt;
+		conn->write((void*)ss.str().data(), ss.str().size());
+		});
+
+	auto err = svr.start();
+	if (err) {
+		LOG(ERROR) << err->what();
+		return -1;
+	}
+	LOG(INFO) << "server listen on: " << port << " with " << svr.workers() << " workers";
+
+	stopcon.wait();
+
+	svr.stop();
+	LOG(INFO) << "program exit normally ...";
+	return 0;
+}